@@ -0,0 +1,101 @@
+#ifndef AABB_H_
+#define AABB_H_
+
+#include "ray.h"
+#include "triple.h"
+
+#include <algorithm>
+#include <limits>
+
+class AABB
+{
+    public:
+        Point min;      // lower corner
+        Point max;      // upper corner
+
+        // Default box is empty, growing it by anything yields that thing
+        AABB()
+        :
+            min(std::numeric_limits<double>::infinity(),
+                std::numeric_limits<double>::infinity(),
+                std::numeric_limits<double>::infinity()),
+            max(-std::numeric_limits<double>::infinity(),
+                -std::numeric_limits<double>::infinity(),
+                -std::numeric_limits<double>::infinity())
+        {}
+
+        AABB(Point const &lo, Point const &hi)
+        :
+            min(lo),
+            max(hi)
+        {}
+
+        // Box covering all of space, used by unbounded objects (planes)
+        static AABB infinite()
+        {
+            double inf = std::numeric_limits<double>::infinity();
+            return AABB(Point(-inf, -inf, -inf), Point(inf, inf, inf));
+        }
+
+        bool isFinite() const
+        {
+            for (unsigned i = 0; i != 3; ++i)
+                if (!(max.data[i] - min.data[i] < std::numeric_limits<double>::infinity()))
+                    return false;
+            return true;
+        }
+
+        void grow(Point const &p)
+        {
+            for (unsigned i = 0; i != 3; ++i)
+            {
+                min.data[i] = std::min(min.data[i], p.data[i]);
+                max.data[i] = std::max(max.data[i], p.data[i]);
+            }
+        }
+
+        void grow(AABB const &box)
+        {
+            for (unsigned i = 0; i != 3; ++i)
+            {
+                min.data[i] = std::min(min.data[i], box.min.data[i]);
+                max.data[i] = std::max(max.data[i], box.max.data[i]);
+            }
+        }
+
+        Point centroid() const
+        {
+            return (min + max) * 0.5;
+        }
+
+        // Half the surface area, enough for the SAH cost ratio
+        double halfArea() const
+        {
+            Vector d = max - min;
+            if (d.x < 0 || d.y < 0 || d.z < 0)
+                return 0;
+            return d.x * d.y + d.y * d.z + d.z * d.x;
+        }
+
+        // Slab test against [0, tmax), invD is the per-component
+        // reciprocal of the ray direction
+        bool hit(Ray const &ray, Vector const &invD, double tmax) const
+        {
+            double t0 = 0;
+            double t1 = tmax;
+            for (unsigned i = 0; i != 3; ++i)
+            {
+                double tNear = (min.data[i] - ray.O.data[i]) * invD.data[i];
+                double tFar  = (max.data[i] - ray.O.data[i]) * invD.data[i];
+                if (tNear > tFar)
+                    std::swap(tNear, tFar);
+                t0 = tNear > t0 ? tNear : t0;
+                t1 = tFar < t1 ? tFar : t1;
+                if (t0 > t1)
+                    return false;
+            }
+            return true;
+        }
+};
+
+#endif
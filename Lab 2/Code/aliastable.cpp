@@ -0,0 +1,51 @@
+#include "aliastable.h"
+
+using namespace std;
+
+AliasTable::AliasTable(vector<double> const &weights)
+:
+    d_bins(weights.size()),
+    d_pdf(weights.size())
+{
+    size_t n = weights.size();
+    if (n == 0)
+        return;
+
+    double total = 0.0;
+    for (double weight : weights)
+        total += weight;
+    for (size_t idx = 0; idx != n; ++idx)
+        d_pdf[idx] = total > 0 ? weights[idx] / total : 1.0 / n;
+
+    // 1. Scale to a mean of 1, then split into bins below and above it.
+    vector<double> scaled(n);
+    vector<uint32_t> small;
+    vector<uint32_t> large;
+    for (size_t idx = 0; idx != n; ++idx)
+    {
+        scaled[idx] = d_pdf[idx] * n;
+        (scaled[idx] < 1.0 ? small : large).push_back(idx);
+    }
+
+    // 2. Fill every small bin up to 1 from a large one, which may then
+    //    become small itself.
+    while (!small.empty() && !large.empty())
+    {
+        uint32_t less = small.back();
+        small.pop_back();
+        uint32_t more = large.back();
+        d_bins[less] = Bin{scaled[less], more};
+        scaled[more] -= 1.0 - scaled[less];
+        if (scaled[more] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(more);
+        }
+    }
+
+    // 3. What is left is 1 up to rounding.
+    for (uint32_t idx : large)
+        d_bins[idx] = Bin{1.0, idx};
+    for (uint32_t idx : small)
+        d_bins[idx] = Bin{1.0, idx};
+}
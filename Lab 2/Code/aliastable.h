@@ -0,0 +1,50 @@
+#ifndef ALIASTABLE_H_
+#define ALIASTABLE_H_
+
+#include <cstdint>
+#include <vector>
+
+// Walker's alias method (with Vose's construction): picks index i with
+// probability proportional to weight i in constant time, from a single
+// uniform number, whatever the number of weights.
+class AliasTable
+{
+    struct Bin
+    {
+        double threshold;   // below it the bin's own index, else the alias
+        uint32_t alias;
+    };
+
+    std::vector<Bin> d_bins;
+    std::vector<double> d_pdf;
+
+    public:
+        AliasTable() = default;
+
+        // weights >= 0; all zero picks uniformly
+        explicit AliasTable(std::vector<double> const &weights);
+
+        unsigned size() const
+        {
+            return d_bins.size();
+        }
+
+        // index for u in [0, 1)
+        unsigned sample(double u) const
+        {
+            double scaled = u * d_bins.size();
+            unsigned idx = unsigned(scaled);
+            if (idx >= d_bins.size())
+                idx = d_bins.size() - 1;
+            Bin const &bin = d_bins[idx];
+            return scaled - idx < bin.threshold ? idx : bin.alias;
+        }
+
+        // probability of picking idx
+        double pdf(unsigned idx) const
+        {
+            return d_pdf[idx];
+        }
+};
+
+#endif
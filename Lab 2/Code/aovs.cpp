@@ -0,0 +1,136 @@
+#include "aovs.h"
+
+#include "image.h"
+#include "imagewriter.h"
+#include "scene.h"
+
+#include <algorithm>
+
+using namespace std;
+
+static char const *const NAMES[AOVs::NUM_LAYERS] =
+{
+    "depth", "normal", "id", "ambient", "diffuse", "specular", "reflection"
+};
+
+AOVs::AOVs() = default;
+
+AOVs::~AOVs() = default;
+
+AOVs::Layer AOVs::layer(string const &name)
+{
+    unsigned idx = 0;
+    while (idx != NUM_LAYERS && name != NAMES[idx])
+        ++idx;
+    return Layer(idx);
+}
+
+char const *AOVs::name(Layer layer)
+{
+    return NAMES[layer];
+}
+
+void AOVs::select(Layer layer)
+{
+    d_selected[layer] = true;
+}
+
+bool AOVs::empty() const
+{
+    for (bool selected : d_selected)
+        if (selected)
+            return false;
+    return true;
+}
+
+bool AOVs::open(string const &filename, unsigned width, unsigned height)
+{
+    // out.png -> out, but not ./out -> .
+    string base = filename;
+    size_t dot = base.find_last_of('.');
+    if (dot != string::npos && dot > base.find_last_of('/') + 1)
+        base.erase(dot);
+
+    d_width = width;
+    for (unsigned idx = 0; idx != NUM_LAYERS; ++idx)
+    {
+        if (!d_selected[idx])
+            continue;
+        d_writers[idx].reset(new EXRWriter(false));
+        if (!d_writers[idx]->open(base + '.' + NAMES[idx] + ".exr", width, height))
+            return false;
+    }
+    return true;
+}
+
+void AOVs::resize(unsigned rows)
+{
+    size_t n = size_t(d_width) * rows;
+    for (unsigned idx = 0; idx != NUM_LAYERS; ++idx)
+        if (d_selected[idx])
+            d_sums[idx].assign(3 * n, 0.0f);
+    d_samples.assign(n, 0);
+    d_hits.assign(n, 0);
+}
+
+void AOVs::add(unsigned x, unsigned y, Surface const &surface)
+{
+    size_t p = size_t(y) * d_width + x;
+    auto add = [&](Layer layer, Triple const &value)
+    {
+        if (d_selected[layer])
+            for (unsigned k = 0; k != 3; ++k)
+                d_sums[layer][3 * p + k] += value.data[k];
+    };
+
+    if (d_samples[p]++ == 0 && d_selected[OBJECT_ID])
+    {
+        float id = surface.obj ? surface.obj->id : 0;
+        for (unsigned k = 0; k != 3; ++k)
+            d_sums[OBJECT_ID][3 * p + k] = id;
+    }
+    if (!surface.obj)
+        return;
+
+    ++d_hits[p];
+    add(DEPTH, Triple(surface.t, surface.t, surface.t));
+    add(NORMAL, surface.N);
+    add(AMBIENT, surface.lobes.ambient);
+    add(DIFFUSE, surface.lobes.diffuse);
+    add(SPECULAR, surface.lobes.specular);
+    add(REFLECTION, surface.lobes.reflection);
+}
+
+void AOVs::write(unsigned y0, unsigned first, unsigned rows)
+{
+    Image band(d_width, rows);
+    for (unsigned idx = 0; idx != NUM_LAYERS; ++idx)
+    {
+        if (!d_selected[idx])
+            continue;
+
+        // depth and normal per hit, the lobes per sample, ids as they are
+        vector<float> const &sums = d_sums[idx];
+        for (unsigned y = 0; y != rows; ++y)
+        {
+            for (unsigned x = 0; x != d_width; ++x)
+            {
+                size_t p = size_t(first + y) * d_width + x;
+                float count = idx == OBJECT_ID ? 1.0f
+                    : float(max(idx <= NORMAL ? d_hits[p] : d_samples[p], 1u));
+                band(x, y) = Color(sums[3 * p] / count, sums[3 * p + 1] / count,
+                                   sums[3 * p + 2] / count);
+            }
+        }
+        d_writers[idx]->write(band, y0);
+    }
+}
+
+bool AOVs::close()
+{
+    bool ok = true;
+    for (auto &writer : d_writers)
+        if (writer && !writer->close())
+            ok = false;
+    return ok;
+}
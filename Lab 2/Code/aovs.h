@@ -0,0 +1,71 @@
+#ifndef AOVS_H_
+#define AOVS_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class ImageWriter;
+struct Surface;
+
+// Arbitrary output variables: images besides the color, gathered from the
+// same samples in the same pass and written band by band to an EXR file
+// per layer. Depth and normal are the means over the samples that hit
+// something (0 elsewhere), the object id is that of the first sample of a
+// pixel (0 for the background), and the ambient, diffuse and specular
+// lobes and the reflected and refracted light are means over all samples,
+// so they add up to the color.
+class AOVs
+{
+    public:
+        enum Layer
+        {
+            DEPTH,
+            NORMAL,
+            OBJECT_ID,
+            AMBIENT,
+            DIFFUSE,
+            SPECULAR,
+            REFLECTION,
+            NUM_LAYERS
+        };
+
+    private:
+        unsigned d_width = 0;
+        bool d_selected[NUM_LAYERS] = {};
+        std::vector<float> d_sums[NUM_LAYERS];  // 3 per pixel of the band
+        std::vector<unsigned> d_samples;
+        std::vector<unsigned> d_hits;
+        std::unique_ptr<ImageWriter> d_writers[NUM_LAYERS];
+
+    public:
+        AOVs();
+        ~AOVs();
+
+        // "depth", "normal", "id", "ambient", "diffuse", "specular" or
+        // "reflection"; NUM_LAYERS for other names
+        static Layer layer(std::string const &name);
+        static char const *name(Layer layer);
+
+        void select(Layer layer);
+        bool empty() const;
+
+        // open the file of every selected layer, named after filename:
+        // "out.png" gives "out.depth.exr" and so on. False on failure.
+        bool open(std::string const &filename, unsigned width, unsigned height);
+
+        // start a band of rows, clears the sums
+        void resize(unsigned rows);
+
+        // add one sample of band pixel (x, y), misses included. Different
+        // pixels may be added from different threads.
+        void add(unsigned x, unsigned y, Surface const &surface);
+
+        // write band rows [first, first + rows) as image rows from y0
+        void write(unsigned y0, unsigned first, unsigned rows);
+
+        // false if rows are missing or writing failed
+        bool close();
+};
+
+#endif
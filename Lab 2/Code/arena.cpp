@@ -0,0 +1,101 @@
+#include "arena.h"
+
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+#define HUGE_PAGE_SIZE  (size_t(2) << 20)
+
+Arena::Arena(size_t chunkSize)
+:
+    d_cur(nullptr),
+    d_end(nullptr),
+    d_chunkSize(chunkSize),
+    d_used(0),
+    d_reserved(0),
+    d_hugePages(false)
+{}
+
+Arena::~Arena()
+{
+    release();
+}
+
+void Arena::setHugePages(bool enable)
+{
+    d_hugePages = enable;
+}
+
+void *Arena::allocate(size_t size, size_t align)
+{
+    uintptr_t cur = reinterpret_cast<uintptr_t>(d_cur);
+    uintptr_t aligned = (cur + align - 1) & ~uintptr_t(align - 1);
+    if (!d_cur || aligned + size > reinterpret_cast<uintptr_t>(d_end))
+    {
+        newChunk(size + align);
+        cur = reinterpret_cast<uintptr_t>(d_cur);
+        aligned = (cur + align - 1) & ~uintptr_t(align - 1);
+    }
+
+    d_cur = reinterpret_cast<char *>(aligned + size);
+    d_used += size;
+    return reinterpret_cast<void *>(aligned);
+}
+
+void Arena::newChunk(size_t minSize)
+{
+    size_t size = max(d_chunkSize, minSize);
+    void *base = MAP_FAILED;
+
+    if (d_hugePages)
+    {
+        // 1. Explicit huge pages if some are reserved, otherwise ask for
+        //    transparent ones on a normal mapping.
+        size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        base = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (base == MAP_FAILED)
+    {
+        base = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            throw bad_alloc();
+        if (d_hugePages)
+            madvise(base, size, MADV_HUGEPAGE);
+    }
+
+    d_chunks.push_back(Chunk{static_cast<char *>(base), size});
+    d_cur = static_cast<char *>(base);
+    d_end = d_cur + size;
+    d_reserved += size;
+}
+
+void Arena::release()
+{
+    // Destroy in reverse order of creation, like automatic objects
+    for (auto it = d_cleanups.rbegin(); it != d_cleanups.rend(); ++it)
+        it->destroy(it->object);
+    d_cleanups.clear();
+
+    for (Chunk const &chunk : d_chunks)
+        munmap(chunk.base, chunk.size);
+    d_chunks.clear();
+
+    d_cur = nullptr;
+    d_end = nullptr;
+    d_used = 0;
+    d_reserved = 0;
+}
+
+size_t Arena::bytesUsed() const
+{
+    return d_used;
+}
+
+size_t Arena::bytesReserved() const
+{
+    return d_reserved;
+}
@@ -0,0 +1,102 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Monotonic (bump) allocator for data that lives as long as the scene.
+// Memory is only returned all at once by release() or the destructor.
+// Objects with a non-trivial destructor are remembered and destroyed
+// then; trivially destructible ones (all plain shapes) cost nothing.
+class Arena
+{
+    struct Chunk
+    {
+        char *base;
+        size_t size;
+    };
+
+    struct Cleanup
+    {
+        void (*destroy)(void *);
+        void *object;
+    };
+
+    std::vector<Chunk> d_chunks;
+    std::vector<Cleanup> d_cleanups;
+    char *d_cur;
+    char *d_end;
+    size_t d_chunkSize;
+    size_t d_used;
+    size_t d_reserved;
+    bool d_hugePages;
+
+    public:
+        explicit Arena(size_t chunkSize = size_t(4) << 20);
+        ~Arena();
+
+        Arena(Arena const &other) = delete;
+        Arena &operator=(Arena const &other) = delete;
+
+        // Back new chunks with huge pages (2 MiB) where the system allows
+        void setHugePages(bool enable);
+
+        void *allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+        // Construct a T in the arena
+        template <typename T, typename ...Args>
+        T *create(Args &&...args);
+
+        // Default constructed array of n Ts
+        template <typename T>
+        T *createArray(size_t n);
+
+        // Destroy everything and unmap all chunks
+        void release();
+
+        size_t bytesUsed() const;       // handed out by allocate
+        size_t bytesReserved() const;   // mapped from the system
+
+    private:
+        void newChunk(size_t minSize);
+
+        template <typename T>
+        void registerCleanup(T *object);
+};
+
+template <typename T, typename ...Args>
+T *Arena::create(Args &&...args)
+{
+    T *object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    registerCleanup(object);
+    return object;
+}
+
+template <typename T>
+T *Arena::createArray(size_t n)
+{
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena arrays are never destroyed");
+    T *array = static_cast<T *>(allocate(n * sizeof(T), alignof(T)));
+    for (size_t i = 0; i != n; ++i)
+        new (array + i) T();
+    return array;
+}
+
+template <typename T>
+void Arena::registerCleanup(T *object)
+{
+    if (std::is_trivially_destructible<T>::value)
+        return;
+    d_cleanups.push_back(Cleanup{
+        [](void *ptr)
+        {
+            static_cast<T *>(ptr)->~T();
+        },
+        object});
+}
+
+#endif
@@ -0,0 +1,103 @@
+#include "blockcache.h"
+
+#include <sys/mman.h>
+#include <algorithm>
+
+using namespace std;
+
+BlockCache::BlockCache()
+:
+    d_offset(0),
+    d_blockSize(0),
+    d_maxResident(0),
+    d_numResident(0),
+    d_loads(0),
+    d_evictions(0),
+    d_peakResident(0)
+{}
+
+bool BlockCache::open(string const &filename, size_t offset, size_t blockSize,
+                      uint32_t numBlocks, size_t budget, unsigned threads)
+{
+    if (!d_file.open(filename) || d_file.size() < offset + numBlocks * blockSize)
+        return false;
+
+    d_offset = offset;
+    d_blockSize = blockSize;
+    d_maxResident = max<size_t>(budget / blockSize, max(1u, threads));
+    d_entries.assign(numBlocks, Entry{0, false, d_lru.end()});
+    d_lru.clear();
+    d_numResident = 0;
+
+    // Nothing is resident until asked for
+    madvise(d_file.data(), d_file.size(), MADV_RANDOM);
+    return true;
+}
+
+char const *BlockCache::acquire(uint32_t block)
+{
+    char *data = d_file.data() + d_offset + block * d_blockSize;
+
+    lock_guard<mutex> lock(d_lock);
+    Entry &entry = d_entries[block];
+    if (entry.resident)
+    {
+        d_lru.splice(d_lru.begin(), d_lru, entry.lruPos);
+    }
+    else
+    {
+        // 1. Make room by dropping the coldest unpinned blocks.
+        auto victim = d_lru.end();
+        while (d_numResident >= d_maxResident && victim != d_lru.begin())
+        {
+            --victim;
+            if (d_entries[*victim].pins != 0)
+                continue;
+            uint32_t cold = *victim;
+            victim = d_lru.erase(victim);
+            evict(cold);
+        }
+
+        // 2. Ask for the whole block at once, the faults are then served
+        //    with a single read-ahead.
+        madvise(data, d_blockSize, MADV_WILLNEED);
+        d_lru.push_front(block);
+        entry.lruPos = d_lru.begin();
+        entry.resident = true;
+        ++d_numResident;
+        ++d_loads;
+        d_peakResident = max(d_peakResident, d_numResident);
+    }
+    ++entry.pins;
+    return data;
+}
+
+void BlockCache::release(uint32_t block)
+{
+    lock_guard<mutex> lock(d_lock);
+    --d_entries[block].pins;
+}
+
+void BlockCache::evict(uint32_t block)
+{
+    madvise(d_file.data() + d_offset + block * d_blockSize, d_blockSize,
+            MADV_DONTNEED);
+    d_entries[block].resident = false;
+    --d_numResident;
+    ++d_evictions;
+}
+
+size_t BlockCache::loads() const
+{
+    return d_loads;
+}
+
+size_t BlockCache::evictions() const
+{
+    return d_evictions;
+}
+
+size_t BlockCache::peakResidentBytes() const
+{
+    return d_peakResident * d_blockSize;
+}
@@ -0,0 +1,62 @@
+#ifndef BLOCKCACHE_H_
+#define BLOCKCACHE_H_
+
+#include "mappedfile.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Resident set over the fixed-size blocks of a mapped file. At most
+// budget / blockSize blocks are kept in memory; when another one is needed
+// the least recently used unpinned block is dropped from the page cache.
+class BlockCache
+{
+    struct Entry
+    {
+        unsigned pins;
+        bool resident;
+        std::list<uint32_t>::iterator lruPos;
+    };
+
+    MappedFile d_file;
+    size_t d_offset;                // file offset of block 0
+    size_t d_blockSize;
+    size_t d_maxResident;
+    std::vector<Entry> d_entries;
+    std::list<uint32_t> d_lru;      // resident blocks, most recent first
+    size_t d_numResident;
+    std::mutex d_lock;
+
+    // Statistics
+    size_t d_loads;
+    size_t d_evictions;
+    size_t d_peakResident;
+
+    public:
+        BlockCache();
+
+        // Map numBlocks blocks of blockSize bytes starting at offset, both
+        // multiples of the page size. A budget smaller than one block per
+        // render thread is raised to that.
+        bool open(std::string const &filename, size_t offset,
+                  size_t blockSize, uint32_t numBlocks, size_t budget,
+                  unsigned threads);
+
+        // Pin a block in memory, paging it in if needed. Every acquire
+        // needs a matching release.
+        char const *acquire(uint32_t block);
+        void release(uint32_t block);
+
+        size_t loads() const;
+        size_t evictions() const;
+        size_t peakResidentBytes() const;
+
+    private:
+        void evict(uint32_t block);
+};
+
+#endif
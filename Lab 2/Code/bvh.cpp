@@ -0,0 +1,467 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+using namespace std;
+
+// Cache file layout: Header, Node[numNodes], uint32_t[numIndices]
+namespace
+{
+    char const CACHE_MAGIC[8] = {'R', 'A', 'Y', 'B', 'V', 'H', '0', '2'};
+
+    struct Header
+    {
+        char magic[8];
+        uint64_t key;
+        uint32_t numObjects;
+        uint32_t numNodes;
+        uint32_t numIndices;
+        uint32_t nodeSize;
+    };
+}
+
+// --- Construction ------------------------------------------------------------
+
+BVH::BVH()
+:
+    d_objects(nullptr),
+    d_primBounds(nullptr),
+    d_centroids(nullptr),
+    d_nodes(nullptr),
+    d_indices(nullptr),
+    d_numIndices(0),
+    d_final(nullptr),
+    d_numNodes(0)
+{}
+
+void BVH::build(vector<ObjectPtr> const &objects, bool lazy, Arena &arena)
+{
+    d_objects = &objects;
+    d_cache.close();
+    d_unbounded.clear();
+
+    // 1. Split off the unbounded objects, cache bounds of the others.
+    d_primBounds = arena.createArray<AABB>(objects.size());
+    d_centroids = arena.createArray<Point>(objects.size());
+    d_indices = arena.createArray<uint32_t>(objects.size());
+    d_numIndices = 0;
+    AABB root;
+    for (uint32_t i = 0; i != objects.size(); ++i)
+    {
+        AABB box = objects[i]->bounds();
+        if (!box.isFinite())
+        {
+            d_unbounded.push_back(i);
+            continue;
+        }
+        d_primBounds[i] = box;
+        d_centroids[i] = box.centroid();
+        d_indices[d_numIndices++] = i;
+        root.grow(box);
+    }
+
+    // 2. A binary tree with non-empty leaves has at most 2n - 1 nodes,
+    //    reserving them up front keeps node references stable while
+    //    other threads refine the tree.
+    size_t maxNodes = max<size_t>(1, 2 * d_numIndices);
+    d_nodes = arena.createArray<Node>(maxNodes);
+    d_final = arena.createArray<atomic<bool>>(maxNodes);
+
+    Node &rootNode = d_nodes[0];
+    rootNode.box = root;
+    rootNode.first = 0;
+    rootNode.count = d_numIndices;
+    rootNode.depth = 0;
+    d_numNodes.store(1);
+
+    if (lazy)
+        return;
+
+    // 3. Eager build: refine everything up front, depth first.
+    vector<uint32_t> stack(1, 0);
+    while (!stack.empty())
+    {
+        uint32_t idx = stack.back();
+        stack.pop_back();
+        if (subdivide(idx))
+        {
+            stack.push_back(d_nodes[idx].first);
+            stack.push_back(d_nodes[idx].first + 1);
+        }
+        d_final[idx].store(true, memory_order_relaxed);
+    }
+}
+
+bool BVH::load(vector<ObjectPtr> const &objects, string const &filename,
+               uint64_t key, Arena &arena)
+{
+    d_objects = &objects;
+    d_primBounds = nullptr;
+    d_centroids = nullptr;
+    d_nodes = nullptr;
+    d_indices = nullptr;
+    d_numIndices = 0;
+    d_numNodes.store(0);
+    if (!d_cache.open(filename))
+        return false;
+
+    // 1. Validate the header against what we are about to trace.
+    Header header;
+    if (d_cache.size() < sizeof(Header))
+    {
+        d_cache.close();
+        return false;
+    }
+    memcpy(&header, d_cache.data(), sizeof(Header));
+    size_t expected = sizeof(Header) + header.numNodes * sizeof(Node)
+                    + header.numIndices * sizeof(uint32_t);
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+        || header.key != key
+        || header.numObjects != objects.size()
+        || header.nodeSize != sizeof(Node)
+        || header.numNodes == 0
+        || d_cache.size() != expected)
+    {
+        d_cache.close();
+        return false;
+    }
+
+    // 2. Point straight into the mapping, nothing is copied.
+    d_nodes = reinterpret_cast<Node *>(d_cache.data() + sizeof(Header));
+    d_indices = reinterpret_cast<uint32_t *>(d_nodes + header.numNodes);
+    d_numIndices = header.numIndices;
+    d_numNodes.store(header.numNodes);
+
+    d_final = arena.createArray<atomic<bool>>(header.numNodes);
+    for (size_t i = 0; i != header.numNodes; ++i)
+        d_final[i].store(true, memory_order_relaxed);
+
+    collectUnbounded(objects);
+    return true;
+}
+
+bool BVH::save(string const &filename, uint64_t key)
+{
+    if (!d_nodes)
+        return false;
+    refineAll();
+
+    Header header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.key = key;
+    header.numObjects = d_objects->size();
+    header.numNodes = d_numNodes.load();
+    header.numIndices = d_numIndices;
+    header.nodeSize = sizeof(Node);
+
+    // Write to a temporary first so readers never map a partial file
+    string tmpname = filename + ".tmp";
+    {
+        ofstream out(tmpname, ios::binary | ios::trunc);
+        out.write(reinterpret_cast<char const *>(&header), sizeof(Header));
+        out.write(reinterpret_cast<char const *>(d_nodes),
+                  header.numNodes * sizeof(Node));
+        out.write(reinterpret_cast<char const *>(d_indices),
+                  header.numIndices * sizeof(uint32_t));
+        if (!out)
+            return false;
+    }
+    return rename(tmpname.c_str(), filename.c_str()) == 0;
+}
+
+void BVH::collectUnbounded(vector<ObjectPtr> const &objects)
+{
+    d_unbounded.clear();
+    for (uint32_t i = 0; i != objects.size(); ++i)
+        if (!objects[i]->bounds().isFinite())
+            d_unbounded.push_back(i);
+}
+
+void BVH::refineAll()
+{
+    vector<uint32_t> stack(1, 0);
+    while (!stack.empty())
+    {
+        uint32_t idx = stack.back();
+        stack.pop_back();
+        if (!d_final[idx].load(memory_order_acquire))
+            refine(idx);
+        if (d_nodes[idx].count == 0)
+        {
+            stack.push_back(d_nodes[idx].first);
+            stack.push_back(d_nodes[idx].first + 1);
+        }
+    }
+}
+
+void BVH::refine(uint32_t idx)
+{
+    lock_guard<mutex> lock(d_locks[idx % LOCK_STRIPES]);
+    if (d_final[idx].load(memory_order_relaxed))
+        return;     // another thread got here first
+
+    subdivide(idx);
+    d_final[idx].store(true, memory_order_release);
+}
+
+bool BVH::subdivide(uint32_t idx)
+{
+    Node &node = d_nodes[idx];
+    if (node.count <= FORCE_LEAF_SIZE)
+        return false;
+
+    // Traversal keeps at most one pending sibling per level on its
+    // fixed-size stack, stop splitting before it can overflow.
+    if (node.depth >= STACK_SIZE - 1)
+        return false;
+
+    uint32_t *prims = d_indices + node.first;
+
+    // 1. Bin along the axis with the largest centroid extent.
+    AABB centroids;
+    for (uint32_t i = 0; i != node.count; ++i)
+        centroids.grow(d_centroids[prims[i]]);
+
+    Vector extent = centroids.max - centroids.min;
+    unsigned axis = 0;
+    if (extent.y > extent.data[axis]) axis = 1;
+    if (extent.z > extent.data[axis]) axis = 2;
+    if (extent.data[axis] <= 0)
+        return false;   // all centroids coincide, nothing to split on
+
+    double lo = centroids.min.data[axis];
+    double scale = NUM_BINS / extent.data[axis];
+    auto binOf = [&](uint32_t prim)
+    {
+        unsigned bin = static_cast<unsigned>((d_centroids[prim].data[axis] - lo) * scale);
+        return min<unsigned>(bin, NUM_BINS - 1);
+    };
+
+    AABB binBox[NUM_BINS];
+    uint32_t binCount[NUM_BINS] = {};
+    for (uint32_t i = 0; i != node.count; ++i)
+    {
+        unsigned bin = binOf(prims[i]);
+        ++binCount[bin];
+        binBox[bin].grow(d_primBounds[prims[i]]);
+    }
+
+    // 2. Sweep the bins from the right, then evaluate every split plane
+    //    from the left.
+    double rightArea[NUM_BINS];
+    AABB acc;
+    uint32_t accCount = 0;
+    for (unsigned b = NUM_BINS - 1; b != 0; --b)
+    {
+        acc.grow(binBox[b]);
+        accCount += binCount[b];
+        rightArea[b] = acc.halfArea() * accCount;
+    }
+
+    double bestCost = numeric_limits<double>::infinity();
+    unsigned bestSplit = 0;
+    AABB left;
+    uint32_t leftCount = 0;
+    for (unsigned b = 0; b != NUM_BINS - 1; ++b)
+    {
+        left.grow(binBox[b]);
+        leftCount += binCount[b];
+        double cost = left.halfArea() * leftCount + rightArea[b + 1];
+        if (leftCount != 0 && leftCount != node.count && cost < bestCost)
+        {
+            bestCost = cost;
+            bestSplit = b + 1;
+        }
+    }
+
+    // 3. Keep small nodes as leaves if splitting does not pay off.
+    double leafCost = node.box.halfArea() * node.count;
+    if (bestSplit == 0 || (node.count <= MAX_LEAF_SIZE && bestCost >= leafCost))
+        return false;
+
+    uint32_t *mid = partition(prims, prims + node.count,
+        [&](uint32_t prim)
+        {
+            return binOf(prim) < bestSplit;
+        });
+
+    // 4. Allocate both children, they start out unsplit.
+    uint32_t child = d_numNodes.fetch_add(2);
+    Node &l = d_nodes[child];
+    Node &r = d_nodes[child + 1];
+    l.first = node.first;
+    l.count = mid - prims;
+    r.first = node.first + l.count;
+    r.count = node.count - l.count;
+    l.depth = node.depth + 1;
+    r.depth = node.depth + 1;
+    l.box = AABB();
+    r.box = AABB();
+    for (uint32_t i = 0; i != l.count; ++i)
+        l.box.grow(d_primBounds[prims[i]]);
+    for (uint32_t i = l.count; i != node.count; ++i)
+        r.box.grow(d_primBounds[prims[i]]);
+
+    node.first = child;
+    node.count = 0;
+    node.axis = axis;
+    return true;
+}
+
+// --- Traversal ---------------------------------------------------------------
+
+int BVH::intersect(Ray const &ray, Hit &minHit)
+{
+    int obj = -1;
+    vector<ObjectPtr> const &objects = *d_objects;
+
+    for (uint32_t idx : d_unbounded)
+    {
+        Hit hit(objects[idx]->intersect(ray));
+        if (hit.t > 0 && hit.t < minHit.t)
+        {
+            minHit = hit;
+            obj = idx;
+        }
+    }
+
+    if (d_numIndices == 0)
+        return obj;
+
+    Vector invD(1.0 / ray.D.x, 1.0 / ray.D.y, 1.0 / ray.D.z);
+
+    uint32_t stack[STACK_SIZE];
+    unsigned top = 0;
+    stack[top++] = 0;
+    while (top != 0)
+    {
+        uint32_t idx = stack[--top];
+
+        // The box is fixed once the parent is final, only split nodes
+        // that a ray actually reaches.
+        if (!d_nodes[idx].box.hit(ray, invD, minHit.t))
+            continue;
+        if (!d_final[idx].load(memory_order_acquire))
+            refine(idx);
+
+        Node const &node = d_nodes[idx];
+        if (node.count != 0)
+        {
+            for (uint32_t i = node.first; i != node.first + node.count; ++i)
+            {
+                uint32_t prim = d_indices[i];
+                Hit hit(objects[prim]->intersect(ray));
+                if (hit.t > 0 && hit.t < minHit.t)
+                {
+                    minHit = hit;
+                    obj = prim;
+                }
+            }
+            continue;
+        }
+
+        // Visit the near child first
+        bool flip = ray.D.data[node.axis] < 0;
+        stack[top++] = node.first + (flip ? 0 : 1);
+        stack[top++] = node.first + (flip ? 1 : 0);
+    }
+
+    return obj;
+}
+
+int BVH::occluded(Ray const &ray, double maxT)
+{
+    vector<ObjectPtr> const &objects = *d_objects;
+
+    for (uint32_t idx : d_unbounded)
+    {
+        double t = objects[idx]->intersect(ray).t;
+        if (t > 0 && t < maxT)
+            return idx;
+    }
+
+    if (d_numIndices == 0)
+        return -1;
+
+    Vector invD(1.0 / ray.D.x, 1.0 / ray.D.y, 1.0 / ray.D.z);
+
+    uint32_t stack[STACK_SIZE];
+    unsigned top = 0;
+    stack[top++] = 0;
+    while (top != 0)
+    {
+        uint32_t idx = stack[--top];
+        if (!d_nodes[idx].box.hit(ray, invD, maxT))
+            continue;
+        if (!d_final[idx].load(memory_order_acquire))
+            refine(idx);
+
+        Node const &node = d_nodes[idx];
+        if (node.count != 0)
+        {
+            for (uint32_t i = node.first; i != node.first + node.count; ++i)
+            {
+                uint32_t prim = d_indices[i];
+                double t = objects[prim]->intersect(ray).t;
+                if (t > 0 && t < maxT)
+                    return prim;
+            }
+            continue;
+        }
+
+        // Any hit will do, but the near child is still the likelier one
+        bool flip = ray.D.data[node.axis] < 0;
+        stack[top++] = node.first + (flip ? 0 : 1);
+        stack[top++] = node.first + (flip ? 1 : 0);
+    }
+
+    return -1;
+}
+
+void BVH::collect(Ray const &ray, vector<uint32_t> &found)
+{
+    vector<ObjectPtr> const &objects = *d_objects;
+    found.insert(found.end(), d_unbounded.begin(), d_unbounded.end());
+    if (d_numIndices == 0)
+        return;
+
+    double inf = numeric_limits<double>::infinity();
+    Vector invD(1.0 / ray.D.x, 1.0 / ray.D.y, 1.0 / ray.D.z);
+
+    uint32_t stack[STACK_SIZE];
+    unsigned top = 0;
+    stack[top++] = 0;
+    while (top != 0)
+    {
+        uint32_t idx = stack[--top];
+        if (!d_nodes[idx].box.hit(ray, invD, inf))
+            continue;
+        if (!d_final[idx].load(memory_order_acquire))
+            refine(idx);
+
+        Node const &node = d_nodes[idx];
+        if (node.count == 0)
+        {
+            stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+            continue;
+        }
+        for (uint32_t i = node.first; i != node.first + node.count; ++i)
+            if (objects[d_indices[i]]->bounds().hit(ray, invD, inf))
+                found.push_back(d_indices[i]);
+    }
+}
+
+unsigned BVH::numNodes() const
+{
+    return d_numNodes.load();
+}
+
+unsigned BVH::numPrimitives() const
+{
+    return d_numIndices;
+}
@@ -0,0 +1,99 @@
+#ifndef BVH_H_
+#define BVH_H_
+
+#include "aabb.h"
+#include "arena.h"
+#include "mappedfile.h"
+#include "object.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Bounding volume hierarchy over the scene objects. Built with binned SAH,
+// either eagerly or lazily: in lazy mode a node holds its unsplit primitive
+// range until the first ray reaches it, and is then split on the spot.
+// Splitting is thread safe, so lazy trees can be shared by render threads.
+// A finished tree can be saved to disk and later mapped back in, which
+// skips the build altogether.
+class BVH
+{
+    public:
+        // Flat node layout. Interior nodes store the index of their left
+        // child (the right child directly follows it), leaves a range
+        // into the primitive index array.
+        struct Node
+        {
+            AABB box;
+            uint32_t first;     // left child or first primitive
+            uint32_t count;     // number of primitives, 0 when interior
+            uint32_t axis;      // split axis, for front-to-back traversal
+            uint32_t depth;     // root is 0, bounded by STACK_SIZE
+        };
+
+        enum : unsigned
+        {
+            MAX_LEAF_SIZE = 4,      // always split above this
+            FORCE_LEAF_SIZE = 1,    // never split below this
+            NUM_BINS = 16,          // SAH bins per split
+            STACK_SIZE = 128,       // traversal stack, also caps tree depth
+            LOCK_STRIPES = 64
+        };
+
+    private:
+        std::vector<ObjectPtr> const *d_objects;
+        std::vector<uint32_t> d_unbounded;      // planes, tested linearly
+        AABB *d_primBounds;                     // per object
+        Point *d_centroids;
+        Node *d_nodes;                          // sized for the full tree
+        uint32_t *d_indices;
+        uint32_t d_numIndices;
+        MappedFile d_cache;                     // backs the above if loaded
+        std::atomic<bool> *d_final;
+        std::atomic<uint32_t> d_numNodes;
+        std::mutex d_locks[LOCK_STRIPES];
+
+    public:
+        BVH();
+
+        BVH(BVH const &other) = delete;
+        BVH &operator=(BVH const &other) = delete;
+
+        // Build over the objects, which must outlive the tree. Node and
+        // build data are taken from the arena, so build once per arena.
+        void build(std::vector<ObjectPtr> const &objects, bool lazy,
+                   Arena &arena);
+
+        // Map a tree saved for the same objects. Fails (and leaves the
+        // tree empty) when the file is missing or its key does not match.
+        bool load(std::vector<ObjectPtr> const &objects,
+                  std::string const &filename, uint64_t key, Arena &arena);
+
+        // Write the tree, splitting whatever a lazy build left unsplit
+        bool save(std::string const &filename, uint64_t key);
+
+        // Nearest hit with 0 < t < hit.t; updates hit and returns the
+        // object index, or -1 when nothing closer was found
+        int intersect(Ray const &ray, Hit &hit);
+
+        // Index of any object hit with 0 < t < maxT, or -1. Stops at the
+        // first one found, so it need not be the nearest (shadow rays).
+        int occluded(Ray const &ray, double maxT);
+
+        // Indices of all objects whose bounds the ray passes through,
+        // ignoring occlusion (used to queue rays per object)
+        void collect(Ray const &ray, std::vector<uint32_t> &objects);
+
+        unsigned numNodes() const;      // nodes allocated so far
+        unsigned numPrimitives() const; // bounded objects in the tree
+
+    private:
+        void refine(uint32_t idx);      // finalize node idx under its lock
+        void refineAll();
+        void collectUnbounded(std::vector<ObjectPtr> const &objects);
+        bool subdivide(uint32_t idx);   // false when idx becomes a leaf
+};
+
+#endif
@@ -0,0 +1,497 @@
+#include "deflate.h"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+using namespace std;
+
+#define WINDOW_SIZE     32768
+#define MIN_MATCH       3
+#define MAX_MATCH       258
+#define HASH_BITS       15
+#define NO_POS          0xffffffffu
+#define BLOCK_SYMBOLS   65536       // symbols per dynamic block
+
+namespace
+{
+    // Match search effort per level: chain length and "good enough" length
+    struct Level
+    {
+        unsigned chain;
+        unsigned nice;
+    };
+
+    Level const LEVELS[10] =
+    {
+        {0, 0}, {4, 8}, {8, 16}, {16, 32}, {32, 64},
+        {64, 128}, {128, 128}, {256, MAX_MATCH}, {1024, MAX_MATCH}, {4096, MAX_MATCH}
+    };
+
+    unsigned const LENGTH_BASE[29] =
+    {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    unsigned const LENGTH_EXTRA[29] =
+    {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+    unsigned const DIST_BASE[30] =
+    {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+        8193, 12289, 16385, 24577
+    };
+    unsigned const DIST_EXTRA[30] =
+    {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+
+    // Order in which the code length code lengths are sent
+    unsigned const CL_ORDER[19] =
+    {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+    };
+
+    // Literal (dist == 0) or match
+    struct Symbol
+    {
+        uint16_t litlen;
+        uint16_t dist;
+    };
+
+    // Deflate streams are filled from the least significant bit up
+    class BitWriter
+    {
+        vector<unsigned char> &d_out;
+        uint64_t d_buffer;
+        unsigned d_count;
+
+        public:
+            explicit BitWriter(vector<unsigned char> &out)
+            :
+                d_out(out),
+                d_buffer(0),
+                d_count(0)
+            {}
+
+            void put(uint32_t bits, unsigned count)
+            {
+                d_buffer |= uint64_t(bits) << d_count;
+                d_count += count;
+                while (d_count >= 8)
+                {
+                    d_out.push_back(d_buffer & 0xff);
+                    d_buffer >>= 8;
+                    d_count -= 8;
+                }
+            }
+
+            void align()
+            {
+                if (d_count != 0)
+                    put(0, 8 - d_count);
+            }
+
+            vector<unsigned char> &bytes()
+            {
+                return d_out;
+            }
+    };
+
+    unsigned lengthCode(unsigned length)
+    {
+        return upper_bound(LENGTH_BASE, LENGTH_BASE + 29, length) - LENGTH_BASE - 1;
+    }
+
+    unsigned distCode(unsigned dist)
+    {
+        return upper_bound(DIST_BASE, DIST_BASE + 30, dist) - DIST_BASE - 1;
+    }
+
+    // Huffman code lengths of at most limit bits for the given frequencies
+    vector<uint8_t> codeLengths(vector<uint32_t> const &freq, unsigned limit)
+    {
+        vector<uint8_t> lengths(freq.size(), 0);
+        vector<unsigned> used;
+        for (unsigned i = 0; i != freq.size(); ++i)
+            if (freq[i] != 0)
+                used.push_back(i);
+        if (used.size() < 2)
+        {
+            if (used.size() == 1)
+                lengths[used[0]] = 1;
+            return lengths;
+        }
+
+        // 1. Plain Huffman tree, internal nodes get increasing indices.
+        unsigned m = used.size();
+        vector<unsigned> parent(2 * m - 1, 0);
+        typedef pair<uint64_t, unsigned> Item;
+        priority_queue<Item, vector<Item>, greater<Item>> heap;
+        for (unsigned k = 0; k != m; ++k)
+            heap.push(Item(freq[used[k]], k));
+        unsigned next = m;
+        while (heap.size() > 1)
+        {
+            Item a = heap.top();
+            heap.pop();
+            Item b = heap.top();
+            heap.pop();
+            parent[a.second] = parent[b.second] = next;
+            heap.push(Item(a.first + b.first, next++));
+        }
+
+        vector<unsigned> depth(2 * m - 1, 0);
+        for (unsigned node = 2 * m - 2; node-- != 0; )
+            depth[node] = depth[parent[node]] + 1;
+
+        // 2. Clamp to the limit, then repair the Kraft sum by moving
+        //    codes down from shorter lengths.
+        vector<unsigned> count(limit + 1, 0);
+        for (unsigned k = 0; k != m; ++k)
+            ++count[min(depth[k], limit)];
+        uint32_t total = 0;
+        for (unsigned len = 1; len <= limit; ++len)
+            total += count[len] << (limit - len);
+        while (total != (1u << limit))
+        {
+            --count[limit];
+            for (unsigned len = limit - 1; len != 0; --len)
+            {
+                if (count[len] != 0)
+                {
+                    --count[len];
+                    count[len + 1] += 2;
+                    break;
+                }
+            }
+            --total;
+        }
+
+        // 3. Shortest codes to the most frequent symbols.
+        stable_sort(used.begin(), used.end(), [&](unsigned a, unsigned b)
+        {
+            return freq[a] > freq[b];
+        });
+        unsigned idx = 0;
+        for (unsigned len = 1; len <= limit; ++len)
+            for (unsigned c = 0; c != count[len]; ++c)
+                lengths[used[idx++]] = len;
+        return lengths;
+    }
+
+    // Canonical codes, bit reversed for the LSB-first stream
+    vector<uint16_t> canonicalCodes(vector<uint8_t> const &lengths)
+    {
+        unsigned blCount[16] = {};
+        for (uint8_t len : lengths)
+            ++blCount[len];
+        blCount[0] = 0;
+
+        unsigned nextCode[16] = {};
+        unsigned code = 0;
+        for (unsigned bits = 1; bits != 16; ++bits)
+        {
+            code = (code + blCount[bits - 1]) << 1;
+            nextCode[bits] = code;
+        }
+
+        vector<uint16_t> codes(lengths.size(), 0);
+        for (unsigned i = 0; i != lengths.size(); ++i)
+        {
+            unsigned len = lengths[i];
+            if (len == 0)
+                continue;
+            unsigned c = nextCode[len]++;
+            unsigned reversed = 0;
+            for (unsigned b = 0; b != len; ++b)
+                reversed |= ((c >> b) & 1) << (len - 1 - b);
+            codes[i] = reversed;
+        }
+        return codes;
+    }
+
+    // Both trees need two codes for old decoders to accept them
+    void ensureTwoCodes(vector<uint32_t> &freq)
+    {
+        unsigned used = count_if(freq.begin(), freq.end(), [](uint32_t f)
+        {
+            return f != 0;
+        });
+        for (unsigned i = 0; used < 2 && i != freq.size(); ++i)
+        {
+            if (freq[i] == 0)
+            {
+                freq[i] = 1;
+                ++used;
+            }
+        }
+    }
+
+    void writeStored(BitWriter &bw, unsigned char const *data, size_t size, bool last)
+    {
+        do
+        {
+            size_t len = min<size_t>(size, 65535);
+            size -= len;
+            bw.put(last && size == 0, 1);
+            bw.put(0, 2);
+            bw.align();
+            bw.put(len, 16);
+            bw.put(~len & 0xffff, 16);
+            bw.bytes().insert(bw.bytes().end(), data, data + len);
+            data += len;
+        }
+        while (size != 0);
+    }
+
+    void writeDynamic(BitWriter &bw, Symbol const *syms, size_t count, bool last)
+    {
+        // 1. Symbol statistics and the two trees.
+        vector<uint32_t> litFreq(286, 0);
+        vector<uint32_t> distFreq(30, 0);
+        for (size_t i = 0; i != count; ++i)
+        {
+            if (syms[i].dist == 0)
+                ++litFreq[syms[i].litlen];
+            else
+            {
+                ++litFreq[257 + lengthCode(syms[i].litlen)];
+                ++distFreq[distCode(syms[i].dist)];
+            }
+        }
+        litFreq[256] = 1;
+        ensureTwoCodes(litFreq);
+        ensureTwoCodes(distFreq);
+
+        vector<uint8_t> litLen = codeLengths(litFreq, 15);
+        vector<uint8_t> distLen = codeLengths(distFreq, 15);
+        vector<uint16_t> litCode = canonicalCodes(litLen);
+        vector<uint16_t> distCodes = canonicalCodes(distLen);
+
+        unsigned hlit = 286;
+        while (hlit > 257 && litLen[hlit - 1] == 0)
+            --hlit;
+        unsigned hdist = 30;
+        while (hdist > 1 && distLen[hdist - 1] == 0)
+            --hdist;
+
+        // 2. Run length encode both length sequences together.
+        vector<uint8_t> all(litLen.begin(), litLen.begin() + hlit);
+        all.insert(all.end(), distLen.begin(), distLen.begin() + hdist);
+
+        vector<pair<uint8_t, uint8_t>> rle;     // symbol, extra bits value
+        for (size_t i = 0; i != all.size(); )
+        {
+            size_t run = 1;
+            while (i + run != all.size() && all[i + run] == all[i])
+                ++run;
+
+            if (all[i] == 0 && run >= 3)
+            {
+                size_t r = min<size_t>(run, 138);
+                if (r >= 11)
+                    rle.push_back(make_pair(18, r - 11));
+                else
+                    rle.push_back(make_pair(17, r - 3));
+                i += r;
+                continue;
+            }
+            if (all[i] != 0 && run >= 4)
+            {
+                rle.push_back(make_pair(all[i], 0));
+                size_t r = min<size_t>(run - 1, 6);
+                rle.push_back(make_pair(16, r - 3));
+                i += 1 + r;
+                continue;
+            }
+            rle.push_back(make_pair(all[i], 0));
+            ++i;
+        }
+
+        vector<uint32_t> clFreq(19, 0);
+        for (auto const &item : rle)
+            ++clFreq[item.first];
+        ensureTwoCodes(clFreq);
+        vector<uint8_t> clLen = codeLengths(clFreq, 7);
+        vector<uint16_t> clCode = canonicalCodes(clLen);
+
+        unsigned hclen = 19;
+        while (hclen > 4 && clLen[CL_ORDER[hclen - 1]] == 0)
+            --hclen;
+
+        // 3. Block header.
+        bw.put(last, 1);
+        bw.put(2, 2);
+        bw.put(hlit - 257, 5);
+        bw.put(hdist - 1, 5);
+        bw.put(hclen - 4, 4);
+        for (unsigned i = 0; i != hclen; ++i)
+            bw.put(clLen[CL_ORDER[i]], 3);
+        for (auto const &item : rle)
+        {
+            bw.put(clCode[item.first], clLen[item.first]);
+            if (item.first == 16) bw.put(item.second, 2);
+            if (item.first == 17) bw.put(item.second, 3);
+            if (item.first == 18) bw.put(item.second, 7);
+        }
+
+        // 4. Data and end of block.
+        for (size_t i = 0; i != count; ++i)
+        {
+            Symbol const &sym = syms[i];
+            if (sym.dist == 0)
+            {
+                bw.put(litCode[sym.litlen], litLen[sym.litlen]);
+                continue;
+            }
+            unsigned lc = lengthCode(sym.litlen);
+            bw.put(litCode[257 + lc], litLen[257 + lc]);
+            bw.put(sym.litlen - LENGTH_BASE[lc], LENGTH_EXTRA[lc]);
+            unsigned dc = distCode(sym.dist);
+            bw.put(distCodes[dc], distLen[dc]);
+            bw.put(sym.dist - DIST_BASE[dc], DIST_EXTRA[dc]);
+        }
+        bw.put(litCode[256], litLen[256]);
+    }
+
+    inline uint32_t hash3(unsigned char const *p)
+    {
+        return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1u << HASH_BITS) - 1);
+    }
+
+    // Greedy LZ77 with hash chains
+    vector<Symbol> findMatches(unsigned char const *data, size_t begin,
+                               size_t end, Level const &level)
+    {
+        size_t windowStart = begin > WINDOW_SIZE ? begin - WINDOW_SIZE : 0;
+        vector<uint32_t> head(1u << HASH_BITS, NO_POS);
+        vector<uint32_t> prev(end - windowStart, NO_POS);
+        auto insert = [&](size_t pos)
+        {
+            if (pos + MIN_MATCH > end)
+                return;
+            uint32_t h = hash3(data + pos);
+            prev[pos - windowStart] = head[h];
+            head[h] = pos - windowStart;
+        };
+
+        for (size_t pos = windowStart; pos != begin; ++pos)
+            insert(pos);        // prime with the preceding chunk
+
+        vector<Symbol> syms;
+        syms.reserve((end - begin) / 2);
+        for (size_t pos = begin; pos < end; )
+        {
+            unsigned bestLen = 0;
+            unsigned bestDist = 0;
+            if (pos + MIN_MATCH <= end)
+            {
+                unsigned maxLen = min<size_t>(MAX_MATCH, end - pos);
+                unsigned chain = level.chain;
+                for (uint32_t cand = head[hash3(data + pos)];
+                     cand != NO_POS && chain-- != 0; cand = prev[cand])
+                {
+                    size_t cpos = windowStart + cand;
+                    if (pos - cpos > WINDOW_SIZE)
+                        break;
+                    if (data[cpos + bestLen] != data[pos + bestLen])
+                        continue;
+                    unsigned len = 0;
+                    while (len != maxLen && data[cpos + len] == data[pos + len])
+                        ++len;
+                    if (len > bestLen)
+                    {
+                        bestLen = len;
+                        bestDist = pos - cpos;
+                        if (len >= level.nice || len == maxLen)
+                            break;
+                    }
+                }
+            }
+
+            insert(pos);
+            if (bestLen >= MIN_MATCH)
+            {
+                syms.push_back(Symbol{uint16_t(bestLen), uint16_t(bestDist)});
+                for (unsigned k = 1; k != bestLen; ++k)
+                    insert(pos + k);
+                pos += bestLen;
+            }
+            else
+            {
+                syms.push_back(Symbol{data[pos], 0});
+                ++pos;
+            }
+        }
+        return syms;
+    }
+}
+
+void deflateChunk(unsigned char const *data, size_t begin, size_t end,
+                  bool last, int level, vector<unsigned char> &out)
+{
+    BitWriter bw(out);
+    level = max(0, min(level, 9));
+
+    if (level == 0)
+    {
+        writeStored(bw, data + begin, end - begin, last);
+    }
+    else
+    {
+        vector<Symbol> syms = findMatches(data, begin, end, LEVELS[level]);
+        size_t from = 0;
+        do
+        {
+            size_t count = min<size_t>(syms.size() - from, BLOCK_SYMBOLS);
+            writeDynamic(bw, syms.data() + from, count, last && from + count == syms.size());
+            from += count;
+        }
+        while (from != syms.size());
+    }
+
+    // Sync flush: an empty stored block leaves the stream byte aligned
+    if (!last)
+        writeStored(bw, nullptr, 0, false);
+    bw.align();
+}
+
+uint32_t adler32(unsigned char const *data, size_t size, uint32_t adler)
+{
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = adler >> 16;
+    while (size != 0)
+    {
+        size_t amount = min<size_t>(size, 5552);    // no overflow before %
+        size -= amount;
+        for (size_t i = 0; i != amount; ++i)
+        {
+            s1 += data[i];
+            s2 += s1;
+        }
+        data += amount;
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return (s2 << 16) | s1;
+}
+
+uint32_t adler32Combine(uint32_t adlerA, uint32_t adlerB, size_t sizeB)
+{
+    uint32_t const BASE = 65521;
+    uint64_t rem = sizeB % BASE;
+    uint64_t sum1 = adlerA & 0xffff;
+    uint64_t sum2 = (rem * sum1) % BASE;
+    sum1 += (adlerB & 0xffff) + BASE - 1;
+    sum2 += (adlerA >> 16) + (adlerB >> 16) + BASE - rem;
+    if (sum1 >= BASE) sum1 -= BASE;
+    if (sum1 >= BASE) sum1 -= BASE;
+    if (sum2 >= 2 * uint64_t(BASE)) sum2 -= 2 * uint64_t(BASE);
+    if (sum2 >= BASE) sum2 -= BASE;
+    return uint32_t(sum1 | (sum2 << 16));
+}
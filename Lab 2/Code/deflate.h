@@ -0,0 +1,24 @@
+#ifndef DEFLATE_H_
+#define DEFLATE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Raw deflate (RFC 1951) encoder for independently compressed chunks that
+// are concatenated into a single stream, the way pigz does it: every chunk
+// but the last ends with an empty stored block, so it ends on a byte
+// boundary and the next chunk can simply be appended.
+
+// Compress data[begin, end), appending to out. Matches may refer back into
+// the 32 KiB before begin. Level 0 stores, 1 (fast) to 9 (best) compress.
+void deflateChunk(unsigned char const *data, size_t begin, size_t end,
+                  bool last, int level, std::vector<unsigned char> &out);
+
+// Adler-32 checksum as used by zlib streams, continuing from adler
+uint32_t adler32(unsigned char const *data, size_t size, uint32_t adler = 1);
+
+// Adler-32 of A followed by B, from the checksums of both and B's length
+uint32_t adler32Combine(uint32_t adlerA, uint32_t adlerB, size_t sizeB);
+
+#endif
@@ -0,0 +1,363 @@
+#include "denoiser.h"
+
+#include "image.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// Passes of the filter, with taps 1, 2, 4, ... pixels apart
+#define ATROUS_ITERATIONS   5
+
+// Edge-stopping: a neighbour's weight is exp(-difference / sigma) for
+// luminance, the difference in units of the standard deviation of the
+// pixel's mean, and exp(-difference^2 / sigma^2) for the other guides.
+#define SIGMA_LUMINANCE 1.0f
+#define SIGMA_NORMAL    0.3f
+#define SIGMA_ALBEDO    0.1f
+#define SIGMA_DEPTH     0.02f   // relative depth change per pixel of distance
+
+// Added to the standard deviation, so pixels without noise stay sharp
+#define EPSILON_LUMINANCE   1e-4f
+
+// B3 spline, the 5 taps of every pass in both directions
+static float const KERNEL[5] = {1 / 16.0f, 1 / 4.0f, 3 / 8.0f, 1 / 4.0f, 1 / 16.0f};
+
+// --- Fast exp ----------------------------------------------------------------
+
+// Below 2^-30 weights are 0: their squares, and their products with the
+// kernel, would otherwise be denormals, which are very slow to compute with.
+#define EXP_CUTOFF  -30.0f
+
+// exp(-x) for x >= 0 to about 1e-4, 0 past the cutoff: 2^v with
+// v = -x log2(e), the integer part of v going into the exponent bits and
+// the fraction through a polynomial. The SSE2 version below computes the
+// same values.
+static float negExp(float x)
+{
+    float v = -x * 1.442695041f;
+    if (!(v > EXP_CUTOFF))
+        return 0.0f;
+    float i = float(int(v));
+    if (i > v)
+        i -= 1.0f;
+    float f = v - i;
+    float p = 1.0f + f * (0.693147182f + f * (0.240226507f + f * (0.0555041087f
+        + f * (0.00961812911f + f * 0.00133335581f))));
+    int32_t bits = (int32_t(i) + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+#ifdef __SSE2__
+static __m128 negExp(__m128 x)
+{
+    __m128 const one = _mm_set1_ps(1.0f);
+    __m128 v = _mm_mul_ps(x, _mm_set1_ps(-1.442695041f));
+    __m128 inRange = _mm_cmpgt_ps(v, _mm_set1_ps(EXP_CUTOFF));
+    v = _mm_and_ps(v, inRange);
+    __m128 i = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+    i = _mm_sub_ps(i, _mm_and_ps(_mm_cmpgt_ps(i, v), one));
+    __m128 f = _mm_sub_ps(v, i);
+    __m128 p = _mm_set1_ps(0.00133335581f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.00961812911f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.0555041087f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.240226507f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.693147182f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), one);
+    __m128i bits = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(i), _mm_set1_epi32(127)), 23);
+    return _mm_and_ps(_mm_mul_ps(p, _mm_castsi128_ps(bits)), inRange);
+}
+#endif
+
+// --- Guides ------------------------------------------------------------------
+
+void Denoiser::resize(unsigned width, unsigned height)
+{
+    d_width = width;
+    d_height = height;
+    size_t n = size_t(width) * height;
+    d_normal.assign(3 * n, 0.0f);
+    d_depth.assign(n, 0.0f);
+    d_albedo.assign(3 * n, 0.0f);
+    d_lum.assign(2 * n, 0.0f);
+    d_samples.assign(n, 0);
+}
+
+void Denoiser::addSample(unsigned x, unsigned y, Color const &color)
+{
+    size_t p = size_t(y) * d_width + x;
+    float lum = 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+    d_lum[2 * p] += lum;
+    d_lum[2 * p + 1] += lum * lum;
+    ++d_samples[p];
+}
+
+void Denoiser::addHit(unsigned x, unsigned y, Vector const &normal, double depth,
+                      Color const &albedo)
+{
+    size_t p = size_t(y) * d_width + x;
+    for (unsigned k = 0; k != 3; ++k)
+    {
+        d_normal[3 * p + k] += normal.data[k];
+        d_albedo[3 * p + k] += albedo.data[k];
+    }
+    d_depth[p] += depth;
+}
+
+// --- Filter ------------------------------------------------------------------
+
+namespace
+{
+    // Planar float buffers of the filter, p is the pixel index
+    struct Planes
+    {
+        unsigned w;
+        unsigned h;
+        float const *normal[3];
+        float const *albedo[3];
+        float const *depth;
+        float const *depthScale;    // 1 / (SIGMA_DEPTH * depth)
+        float const *lumScale;      // 1 / (SIGMA_LUMINANCE * deviation)
+        float const *in[4];         // r, g, b and variance
+        float *out[4];
+        float invStep;
+        unsigned step;
+    };
+
+    inline float luminance(float r, float g, float b)
+    {
+        return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+    }
+
+    void filterPixel(Planes const &pl, unsigned x, unsigned y)
+    {
+        float const invNormal = 1.0f / (SIGMA_NORMAL * SIGMA_NORMAL);
+        float const invAlbedo = 1.0f / (SIGMA_ALBEDO * SIGMA_ALBEDO);
+        size_t p = size_t(y) * pl.w + x;
+        float lum = luminance(pl.in[0][p], pl.in[1][p], pl.in[2][p]);
+        float depthScale = pl.depthScale[p] * pl.invStep;
+        float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        float weights = 0.0f;
+
+        for (int j = -2; j <= 2; ++j)
+        {
+            int qy = int(y) + j * int(pl.step);
+            if (qy < 0 || qy >= int(pl.h))
+                continue;
+            for (int i = -2; i <= 2; ++i)
+            {
+                int qx = int(x) + i * int(pl.step);
+                if (qx < 0 || qx >= int(pl.w))
+                    continue;
+                size_t q = size_t(qy) * pl.w + qx;
+
+                float dn = 0.0f, da = 0.0f;
+                for (unsigned k = 0; k != 3; ++k)
+                {
+                    float n = pl.normal[k][q] - pl.normal[k][p];
+                    float a = pl.albedo[k][q] - pl.albedo[k][p];
+                    dn += n * n;
+                    da += a * a;
+                }
+                float dl = fabs(luminance(pl.in[0][q], pl.in[1][q], pl.in[2][q]) - lum);
+                float dz = fabs(pl.depth[q] - pl.depth[p]);
+                float arg = dl * pl.lumScale[p] + dn * invNormal + da * invAlbedo
+                    + dz * depthScale;
+                float weight = KERNEL[i + 2] * KERNEL[j + 2] * negExp(arg);
+
+                for (unsigned k = 0; k != 3; ++k)
+                    sum[k] += weight * pl.in[k][q];
+                sum[3] += weight * weight * pl.in[3][q];
+                weights += weight;
+            }
+        }
+        for (unsigned k = 0; k != 3; ++k)
+            pl.out[k][p] = sum[k] / weights;
+        pl.out[3][p] = sum[3] / (weights * weights);
+    }
+
+#ifdef __SSE2__
+    inline __m128 luminance(__m128 const *color)
+    {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(color[0], _mm_set1_ps(0.2126f)),
+                                     _mm_mul_ps(color[1], _mm_set1_ps(0.7152f))),
+                          _mm_mul_ps(color[2], _mm_set1_ps(0.0722f)));
+    }
+
+    // Pixels x to x + 3, all of whose taps lie inside the row
+    void filterPixels4(Planes const &pl, unsigned x, unsigned y)
+    {
+        __m128 const invNormal = _mm_set1_ps(1.0f / (SIGMA_NORMAL * SIGMA_NORMAL));
+        __m128 const invAlbedo = _mm_set1_ps(1.0f / (SIGMA_ALBEDO * SIGMA_ALBEDO));
+        __m128 const absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        size_t p = size_t(y) * pl.w + x;
+
+        __m128 center[10];
+        for (unsigned k = 0; k != 3; ++k)
+        {
+            center[k] = _mm_loadu_ps(pl.in[k] + p);
+            center[3 + k] = _mm_loadu_ps(pl.normal[k] + p);
+            center[6 + k] = _mm_loadu_ps(pl.albedo[k] + p);
+        }
+        center[9] = _mm_loadu_ps(pl.depth + p);
+        __m128 lum = luminance(center);
+        __m128 lumScale = _mm_loadu_ps(pl.lumScale + p);
+        __m128 depthScale = _mm_mul_ps(_mm_loadu_ps(pl.depthScale + p),
+                                       _mm_set1_ps(pl.invStep));
+        __m128 sum[4] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+        __m128 weights = _mm_setzero_ps();
+
+        for (int j = -2; j <= 2; ++j)
+        {
+            int qy = int(y) + j * int(pl.step);
+            if (qy < 0 || qy >= int(pl.h))
+                continue;
+            for (int i = -2; i <= 2; ++i)
+            {
+                size_t q = size_t(qy) * pl.w + x + i * int(pl.step);
+
+                __m128 color[3];
+                __m128 dn = _mm_setzero_ps(), da = _mm_setzero_ps();
+                for (unsigned k = 0; k != 3; ++k)
+                {
+                    color[k] = _mm_loadu_ps(pl.in[k] + q);
+                    __m128 n = _mm_sub_ps(_mm_loadu_ps(pl.normal[k] + q), center[3 + k]);
+                    __m128 a = _mm_sub_ps(_mm_loadu_ps(pl.albedo[k] + q), center[6 + k]);
+                    dn = _mm_add_ps(dn, _mm_mul_ps(n, n));
+                    da = _mm_add_ps(da, _mm_mul_ps(a, a));
+                }
+                __m128 dl = _mm_and_ps(_mm_sub_ps(luminance(color), lum), absMask);
+                __m128 dz = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(pl.depth + q), center[9]), absMask);
+                __m128 arg = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dl, lumScale), _mm_mul_ps(dn, invNormal)),
+                                        _mm_add_ps(_mm_mul_ps(da, invAlbedo), _mm_mul_ps(dz, depthScale)));
+                __m128 weight = _mm_mul_ps(_mm_set1_ps(KERNEL[i + 2] * KERNEL[j + 2]), negExp(arg));
+
+                for (unsigned k = 0; k != 3; ++k)
+                    sum[k] = _mm_add_ps(sum[k], _mm_mul_ps(weight, color[k]));
+                sum[3] = _mm_add_ps(sum[3], _mm_mul_ps(_mm_mul_ps(weight, weight),
+                                                       _mm_loadu_ps(pl.in[3] + q)));
+                weights = _mm_add_ps(weights, weight);
+            }
+        }
+        for (unsigned k = 0; k != 3; ++k)
+            _mm_storeu_ps(pl.out[k] + p, _mm_div_ps(sum[k], weights));
+        _mm_storeu_ps(pl.out[3] + p, _mm_div_ps(sum[3], _mm_mul_ps(weights, weights)));
+    }
+#endif
+}
+
+unsigned Denoiser::reach()
+{
+    // 2 taps of 1, 2, 4, ... pixels to either side
+    return 2 * ((1u << ATROUS_ITERATIONS) - 1);
+}
+
+void Denoiser::apply(Image &img, unsigned threads)
+{
+    unsigned w = d_width;
+    unsigned h = d_height;
+    size_t n = size_t(w) * h;
+
+    // 1. Means of the guides over all samples, in planes: misses count as
+    //    zeros, so the guides of a pixel on a silhouette differ from those
+    //    inside.
+    vector<float> guides(9 * n, 0.0f);
+    float *normal[3] = {&guides[0], &guides[n], &guides[2 * n]};
+    float *albedo[3] = {&guides[3 * n], &guides[4 * n], &guides[5 * n]};
+    float *depth = &guides[6 * n];
+    float *depthScale = &guides[7 * n];
+    float *lumScale = &guides[8 * n];
+    for (size_t p = 0; p != n; ++p)
+    {
+        float samples = float(max(d_samples[p], 1u));
+        for (unsigned k = 0; k != 3; ++k)
+        {
+            normal[k][p] = d_normal[3 * p + k] / samples;
+            albedo[k][p] = d_albedo[3 * p + k] / samples;
+        }
+        depth[p] = d_depth[p] / samples;
+        depthScale[p] = 1.0f / (SIGMA_DEPTH * max(depth[p], 1e-3f));
+    }
+
+    // 2. The image and the variance of its pixels (the variance of the
+    //    mean of their samples) in planes, twice to filter back and forth.
+    vector<float> colors(8 * n);
+    vector<float> buffer;
+    for (unsigned y = 0; y != h; ++y)
+    {
+        float const *row = img.floatRow(y, buffer);
+        for (unsigned x = 0; x != w; ++x)
+        {
+            size_t p = size_t(y) * w + x;
+            for (unsigned k = 0; k != 3; ++k)
+                colors[k * n + p] = row[3 * x + k];
+            float samples = float(max(d_samples[p], 1u));
+            float mean = d_lum[2 * p] / samples;
+            colors[3 * n + p] = max(d_lum[2 * p + 1] / samples - mean * mean, 0.0f) / samples;
+        }
+    }
+
+    // 3. The passes, a row per job. The variance is filtered along with the
+    //    color, so the luminance stops relax as the noise goes down.
+    Planes pl;
+    pl.w = w;
+    pl.h = h;
+    for (unsigned k = 0; k != 3; ++k)
+    {
+        pl.normal[k] = normal[k];
+        pl.albedo[k] = albedo[k];
+    }
+    pl.depth = depth;
+    pl.depthScale = depthScale;
+    pl.lumScale = lumScale;
+    for (unsigned pass = 0; pass != ATROUS_ITERATIONS; ++pass)
+    {
+        float *from = &colors[pass % 2 * 4 * n];
+        float *to = &colors[(pass + 1) % 2 * 4 * n];
+        for (unsigned k = 0; k != 4; ++k)
+        {
+            pl.in[k] = from + k * n;
+            pl.out[k] = to + k * n;
+        }
+        pl.step = 1u << pass;
+        pl.invStep = 1.0f / pl.step;
+        for (size_t p = 0; p != n; ++p)
+            lumScale[p] = 1.0f / (SIGMA_LUMINANCE * sqrt(from[3 * n + p]) + EPSILON_LUMINANCE);
+
+        parallelFor(h, threads, [&](unsigned y)
+        {
+            unsigned x = 0;
+#ifdef __SSE2__
+            // taps of 4 pixels from x - 2 step to x + 3 + 2 step
+            unsigned margin = 2 * pl.step;
+            for (; x < min(w, margin); ++x)
+                filterPixel(pl, x, y);
+            for (; x + 3 + margin < w; x += 4)
+                filterPixels4(pl, x, y);
+#endif
+            for (; x != w; ++x)
+                filterPixel(pl, x, y);
+        });
+    }
+
+    // 4. Back into the image.
+    float const *result = &colors[ATROUS_ITERATIONS % 2 * 4 * n];
+    for (unsigned y = 0; y != h; ++y)
+    {
+        for (unsigned x = 0; x != w; ++x)
+        {
+            size_t p = size_t(y) * w + x;
+            img(x, y) = Color(result[p], result[n + p], result[2 * n + p]);
+        }
+    }
+}
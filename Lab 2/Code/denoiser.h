@@ -0,0 +1,48 @@
+#ifndef DENOISER_H_
+#define DENOISER_H_
+
+#include "triple.h"
+
+#include <vector>
+
+class Image;
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010), with the
+// luminance stopping function scaled by the noise of every pixel as in
+// SVGF (Schied et al. 2017). The guides (normal, depth and albedo of the
+// first hit, and mean and variance of the luminance of the samples) are
+// gathered while tracing; the filter blurs where the samples disagree but
+// stops at differences in the guides, so edges, silhouettes and material
+// boundaries stay sharp. Pixels whose samples agree are left as they are,
+// so a single sample per pixel is not filtered.
+class Denoiser
+{
+    unsigned d_width = 0;
+    unsigned d_height = 0;
+    std::vector<float> d_normal;    // x, y, z per pixel, sums until apply
+    std::vector<float> d_depth;
+    std::vector<float> d_albedo;    // r, g, b per pixel
+    std::vector<float> d_lum;       // luminance and its square per pixel
+    std::vector<unsigned> d_samples;
+
+    public:
+        // size of the image (or band) to denoise, clears the guides
+        void resize(unsigned width, unsigned height);
+
+        // add the color of one sample of pixel (x, y), and its first hit;
+        // misses add no hit. Different pixels may be added from different
+        // threads.
+        void addSample(unsigned x, unsigned y, Color const &color);
+        void addHit(unsigned x, unsigned y, Vector const &normal, double depth,
+                    Color const &albedo);
+
+        // filter img (of the same size) in place, rows split over threads
+        void apply(Image &img, unsigned threads);
+
+        // how many pixels away the filter reads from, so a band filtered
+        // with that many rows of its neighbours on both sides comes out
+        // as in the whole image
+        static unsigned reach();
+};
+
+#endif
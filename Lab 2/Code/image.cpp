@@ -1,19 +1,171 @@
 #include "image.h"
 
+#include "pngencoder.h"
 #include "lode/lodepng.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
-Image::Image(unsigned width, unsigned height)
+// --- Half floats -------------------------------------------------------------
+
+// IEEE 754 binary16, round to nearest even
+static uint16_t toHalf(float value)
+{
+    uint32_t f;
+    memcpy(&f, &value, sizeof(f));
+    uint32_t sign = (f >> 16) & 0x8000;
+    int32_t exponent = int32_t((f >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = f & 0x7fffff;
+
+    if (((f >> 23) & 0xff) == 0xff)         // inf or nan
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 31)                     // overflow
+        return sign | 0x7c00;
+    if (exponent <= 0)                      // subnormal or zero
+    {
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        unsigned shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            ++half;
+        return sign | half;
+    }
+
+    uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        ++half;                             // may carry into the exponent
+    return half;
+}
+
+static float fromHalf(uint16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t f;
+
+    if (exponent == 0x1f)
+        f = sign | 0x7f800000 | (mantissa << 13);
+    else if (exponent != 0)
+        f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        f = sign;
+    else
+    {
+        // renormalize the subnormal
+        exponent = 127 - 15 + 1;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            --exponent;
+        }
+        f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+
+    float value;
+    memcpy(&value, &f, sizeof(value));
+    return value;
+}
+
+// --- Quantization ------------------------------------------------------------
+
+#define SRGB_LUT_SIZE   4096
+
+// Clamp to [0, 1], NaN goes to 0 (std::min and std::max pass it on)
+static inline float clamp01(float v)
+{
+    return v > 0.0f ? (v < 1.0f ? v : 1.0f) : 0.0f;
+}
+
+// Linear -> sRGB transfer function, sampled on [0, 1] and interpolated
+// between the samples: the curve is steepest in the darks, where the
+// nearest sample can be off by almost half an 8 bit step.
+static float const *srgbTable()
+{
+    static vector<float> table = []
+    {
+        vector<float> lut(SRGB_LUT_SIZE + 1);
+        for (unsigned i = 0; i <= SRGB_LUT_SIZE; ++i)
+        {
+            double v = double(i) / SRGB_LUT_SIZE;
+            lut[i] = v <= 0.0031308 ? 12.92 * v : 1.055 * pow(v, 1 / 2.4) - 0.055;
+        }
+        return lut;
+    }();
+    return table.data();
+}
+
+// 4x4 Bayer matrix, thresholds (i + 0.5) / 16 in (0, 1)
+static float const BAYER[4][4] =
+{
+    { 0.5f / 16,  8.5f / 16,  2.5f / 16, 10.5f / 16},
+    {12.5f / 16,  4.5f / 16, 14.5f / 16,  6.5f / 16},
+    { 3.5f / 16, 11.5f / 16,  1.5f / 16,  9.5f / 16},
+    {15.5f / 16,  7.5f / 16, 13.5f / 16,  5.5f / 16}
+};
+
+// dst[i] = clamp(src[i], 0, 1) * 255 + offset[i], truncated. An offset of
+// 0.5 rounds to nearest, a dither threshold gives ordered dithering.
+static void quantize(float const *src, float const *offset,
+                     unsigned char *dst, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128 const zero = _mm_setzero_ps();
+    __m128 const one = _mm_set1_ps(1.0f);
+    __m128 const scale = _mm_set1_ps(255.0f);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i q[4];
+        for (unsigned k = 0; k != 4; ++k)
+        {
+            __m128 v = _mm_loadu_ps(src + i + 4 * k);
+            v = _mm_min_ps(_mm_max_ps(v, zero), one);
+            v = _mm_add_ps(_mm_mul_ps(v, scale), _mm_loadu_ps(offset + i + 4 * k));
+            q[k] = _mm_cvttps_epi32(v);
+        }
+        __m128i lo = _mm_packs_epi32(q[0], q[1]);
+        __m128i hi = _mm_packs_epi32(q[2], q[3]);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i != n; ++i)
+    {
+        float v = clamp01(src[i]) * 255.0f + offset[i];
+        dst[i] = static_cast<unsigned char>(min(v, 255.0f));
+    }
+}
+
+// --- Constructors ------------------------------------------------------------
+
+Image::Image(unsigned width, unsigned height, Format format)
 :
-    d_pixels(width * height),
+    d_data(size_t(width) * height * pixelSize(format)),
     d_width(width),
-    d_height(height)
+    d_height(height),
+    d_format(format)
 {}
 
 Image::Image(string const &filename)
+:
+    d_width(0),
+    d_height(0),
+    d_format(RGBA8)
 {
     read_png(filename);
 }
@@ -21,23 +173,27 @@ Image::Image(string const &filename)
 // normal accessors
 void Image::put_pixel(unsigned x, unsigned y, Color const &c)
 {
-    (*this)(x, y) = c;
+    if (x >= d_width || y >= d_height)
+        throw out_of_range("Image::put_pixel: pixel out of range");
+    store(index(x, y), c);
 }
 Color Image::get_pixel(unsigned x, unsigned y) const
 {
-    return (*this)(x, y);
+    if (x >= d_width || y >= d_height)
+        throw out_of_range("Image::get_pixel: pixel out of range");
+    return load(index(x, y));
 }
 
 // Handier accessors
 // Usage: color = img(x,y);
 //        img(x,y) = color;
-Color const&Image::operator()(unsigned x, unsigned y) const
+Color Image::operator()(unsigned x, unsigned y) const
 {
-    return d_pixels.at(index(x, y));
+    return load(index(x, y));
 }
-Color &Image::operator()(unsigned x, unsigned y)
+Image::PixelRef Image::operator()(unsigned x, unsigned y)
 {
-    return d_pixels.at(index(x, y));
+    return PixelRef(*this, index(x, y));
 }
 
 unsigned Image::width() const
@@ -55,45 +211,206 @@ unsigned Image::size() const
     return d_width * d_height;
 }
 
+Image::Format Image::format() const
+{
+    return d_format;
+}
+
+size_t Image::bytes() const
+{
+    return d_data.size();
+}
+
 // Normalized accessors, unsignederval is (0...1, 0...1)
 // usefull for texture access
-Color const &Image::colorAt(float x, float y) const
+Color Image::colorAt(float x, float y) const
 {
-    return d_pixels.at(findex(x, y));
+    return load(findex(x, y));
 }
 
-void Image::write_png(std::string const &filename) const
+void Image::toneMap(ToneMap op, double exposure)
 {
-    vector<unsigned char> image;
-    image.reserve(size() * 4);  // reserves size (less allocations)
-    for (Color pixel : d_pixels)
+    double scale = pow(2.0, exposure);
+    for (size_t idx = 0; idx != size(); ++idx)
     {
-        image.push_back(static_cast<unsigned char>(pixel.r * 255.0));
-        image.push_back(static_cast<unsigned char>(pixel.g * 255.0));
-        image.push_back(static_cast<unsigned char>(pixel.b * 255.0));
-        image.push_back(255);   // alpha is always 1
+        Color c = load(idx) * scale;
+        for (unsigned i = 0; i != 3; ++i)
+        {
+            double v = fmax(c.data[i], 0.0);
+            if (op == REINHARD)
+                c.data[i] = v / (1.0 + v);
+            else if (op == ACES)
+                c.data[i] = v * (2.51 * v + 0.03) / (v * (2.43 * v + 0.59) + 0.14);
+        }
+        store(idx, c);
     }
+}
 
-    lodepng::encode(filename, image, d_width, d_height);
+void Image::toRGBA8(vector<unsigned char> &out, bool srgb, bool dither,
+                    unsigned y0) const
+{
+    out.resize(size_t(size()) * 4);
+    if (d_format == RGBA8 && !srgb && !dither)
+    {
+        copy(d_data.begin(), d_data.end(), out.begin());
+        return;
+    }
+
+    size_t n = size_t(d_width) * 3;
+    vector<float> buffer;
+    vector<float> encoded(n);
+    vector<float> offset(n, 0.5f);
+    vector<unsigned char> rgb(n);
+    float const *lut = srgbTable();
+
+    for (unsigned y = 0; y != d_height; ++y)
+    {
+        float const *row = floatRow(y, buffer);
+
+        // 1. Optional sRGB encoding through the table.
+        if (srgb)
+        {
+            for (size_t i = 0; i != n; ++i)
+            {
+                float x = clamp01(row[i]) * SRGB_LUT_SIZE;
+                unsigned k = min(static_cast<unsigned>(x), unsigned(SRGB_LUT_SIZE - 1));
+                encoded[i] = lut[k] + (x - k) * (lut[k + 1] - lut[k]);
+            }
+            row = encoded.data();
+        }
+
+        // 2. Dither thresholds for this row (all channels of a pixel share one).
+        if (dither)
+            for (size_t i = 0; i != n; ++i)
+                offset[i] = BAYER[(y0 + y) & 3][(i / 3) & 3];
+
+        // 3. Quantize and add alpha.
+        quantize(row, offset.data(), rgb.data(), n);
+        unsigned char *dst = &out[size_t(y) * d_width * 4];
+        for (unsigned x = 0; x != d_width; ++x)
+        {
+            dst[4 * x] = rgb[3 * x];
+            dst[4 * x + 1] = rgb[3 * x + 1];
+            dst[4 * x + 2] = rgb[3 * x + 2];
+            dst[4 * x + 3] = 255;   // alpha is always 1
+        }
+    }
 }
 
-void Image::read_png(std::string const &filename)
+void Image::write_png(std::string const &filename, bool srgb, bool dither,
+                      int level) const
 {
     vector<unsigned char> image;
-    lodepng::decode(image, d_width, d_height, filename);
-    d_pixels.reserve(size());
+    toRGBA8(image, srgb, dither);
+    // alpha is always 1, so the PNG is written as RGB
+    if (!PNGEncoder(level).write(filename, image.data(), d_width, d_height, false))
+        cerr << "Error writing " << filename << endl;
+}
+
+void Image::read_png(std::string const &filename)
+{
+    // Kept as decoded, 8 bit RGBA
+    d_data.clear();
+    d_format = RGBA8;
+    lodepng::decode(d_data, d_width, d_height, filename);
+}
+
+// --- Storage -----------------------------------------------------------------
+
+unsigned Image::pixelSize(Format format)
+{
+    switch (format)
+    {
+        case RGB32F: return 3 * sizeof(float);
+        case RGB16F: return 3 * sizeof(uint16_t);
+        default:     return 4;
+    }
+}
+
+Color Image::load(size_t idx) const
+{
+    unsigned char const *p = &d_data[idx * pixelSize(d_format)];
+    switch (d_format)
+    {
+        case RGB32F:
+        {
+            float f[3];
+            memcpy(f, p, sizeof(f));
+            return Color(f[0], f[1], f[2]);
+        }
+        case RGB16F:
+        {
+            uint16_t h[3];
+            memcpy(h, p, sizeof(h));
+            return Color(fromHalf(h[0]), fromHalf(h[1]), fromHalf(h[2]));
+        }
+        default:
+            return Color(p[0] / 255.0, p[1] / 255.0, p[2] / 255.0);
+    }
+}
+
+void Image::store(size_t idx, Color const &c)
+{
+    unsigned char *p = &d_data[idx * pixelSize(d_format)];
+    switch (d_format)
+    {
+        case RGB32F:
+        {
+            float f[3] = {float(c.r), float(c.g), float(c.b)};
+            memcpy(p, f, sizeof(f));
+            break;
+        }
+        case RGB16F:
+        {
+            uint16_t h[3] = {toHalf(c.r), toHalf(c.g), toHalf(c.b)};
+            memcpy(p, h, sizeof(h));
+            break;
+        }
+        default:
+            for (unsigned i = 0; i != 3; ++i)
+                p[i] = static_cast<unsigned char>(fmin(fmax(c.data[i], 0.0), 1.0) * 255.0 + 0.5);
+            p[3] = 255;
+    }
+}
+
+unsigned char const *Image::rawRow(unsigned y) const
+{
+    return &d_data[index(0, y) * pixelSize(d_format)];
+}
+
+Image Image::rows(unsigned y0, unsigned count) const
+{
+    Image part(d_width, count, d_format);
+    size_t rowBytes = size_t(d_width) * pixelSize(d_format);
+    copy(d_data.begin() + y0 * rowBytes, d_data.begin() + (y0 + count) * rowBytes,
+         part.d_data.begin());
+    return part;
+}
+
+float const *Image::floatRow(unsigned y, vector<float> &buffer) const
+{
+    if (d_format == RGB32F)
+        return reinterpret_cast<float const *>(&d_data[index(0, y) * pixelSize(d_format)]);
+
+    buffer.resize(size_t(d_width) * 3);
+    unsigned char const *src = &d_data[index(0, y) * pixelSize(d_format)];
+    if (d_format == RGB16F)
+    {
+        for (size_t i = 0; i != buffer.size(); ++i)
+        {
+            uint16_t h;
+            memcpy(&h, src + 2 * i, sizeof(h));
+            buffer[i] = fromHalf(h);
+        }
+        return buffer.data();
+    }
 
-    auto imgIter = image.begin();
-    while (imgIter != image.end())
+    for (unsigned x = 0; x != d_width; ++x)
     {
-        double r = (*imgIter) / 255.0;
-        ++imgIter;
-        double g = (*imgIter) / 255.0;
-        ++imgIter;
-        double b = (*imgIter) / 255.0;
-        ++imgIter;
-        // Ignore Alpha
-        ++imgIter;
-        d_pixels.push_back(Color(r, g, b));
+        Color c = load(index(x, y));
+        buffer[3 * x] = c.r;
+        buffer[3 * x + 1] = c.g;
+        buffer[3 * x + 2] = c.b;
     }
+    return buffer.data();
 }
@@ -3,47 +3,129 @@
 
 #include "triple.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
 class Image
 {
-    std::vector<Color> d_pixels;
-    unsigned d_width;
-    unsigned d_height;
+    public:
+        // Pixel storage: float RGB (12 bytes), half float RGB (6 bytes)
+        // or 8 bit RGBA (4 bytes, quantized when written)
+        enum Format
+        {
+            RGB32F,
+            RGB16F,
+            RGBA8
+        };
+
+        // Proxy returned by the non-const operator(), so that
+        // img(x,y) = color; works for every format
+        class PixelRef
+        {
+            Image &d_img;
+            size_t d_idx;
+
+            public:
+                PixelRef(Image &img, size_t idx)
+                :
+                    d_img(img),
+                    d_idx(idx)
+                {}
+
+                PixelRef &operator=(Color const &c)
+                {
+                    d_img.store(d_idx, c);
+                    return *this;
+                }
+
+                // img(x,y) = other(u,v); copies the pixel
+                PixelRef &operator=(PixelRef const &other)
+                {
+                    return *this = Color(other);
+                }
+
+                operator Color() const
+                {
+                    return d_img.load(d_idx);
+                }
+        };
+
+        // Optional post step before quantizing
+        enum ToneMap
+        {
+            LINEAR,     // exposure only, clamped when quantized
+            REINHARD,   // c / (1 + c)
+            ACES        // filmic curve (Narkowicz fit)
+        };
+
+    private:
+        std::vector<unsigned char> d_data;
+        unsigned d_width;
+        unsigned d_height;
+        Format d_format;
 
     public:
-        Image(unsigned width = 0, unsigned height = 0);
+        Image(unsigned width = 0, unsigned height = 0, Format format = RGB32F);
         Image(std::string const &filename);
 
-        // normal accessors
+        // normal accessors, bounds checked
         void put_pixel(unsigned x, unsigned y, Color const &c);
         Color get_pixel(unsigned x, unsigned y) const;
 
-        // Handier accessors
+        // Handier accessors, unchecked (for the render loop)
         // Usage: color = img(x,y);
         //        img(x,y) = color;
-        Color const &operator()(unsigned x, unsigned y) const;
-        Color &operator()(unsigned x, unsigned y);
+        Color operator()(unsigned x, unsigned y) const;
+        PixelRef operator()(unsigned x, unsigned y);
 
         unsigned width() const;
         unsigned height() const;
         unsigned size() const;
+        Format format() const;
+        size_t bytes() const;       // size of the pixel storage
 
         // Normalized accessors, unsignederval is (0...1, 0...1)
         // usefull for texture access
-        Color const &colorAt(float x, float y) const;
+        Color colorAt(float x, float y) const;
+
+        // Scale by 2^exposure and apply op, in place
+        void toneMap(ToneMap op, double exposure = 0.0);
+
+        // Row y as floats (RGB), pointing into the storage for RGB32F and
+        // converted into buffer otherwise
+        float const *floatRow(unsigned y, std::vector<float> &buffer) const;
+
+        // Row y in the storage format
+        unsigned char const *rawRow(unsigned y) const;
 
-        void write_png(std::string const &filename) const;
+        // Copy of rows [y0, y0 + count), in the same format
+        Image rows(unsigned y0, unsigned count) const;
+
+        // Quantize to 8 bit RGBA (alpha 255). Values are clamped to
+        // [0, 1], optionally sRGB encoded and ordered dithered. For a band
+        // of a larger image, y0 is the row the band starts at.
+        void toRGBA8(std::vector<unsigned char> &out, bool srgb = false,
+                     bool dither = false, unsigned y0 = 0) const;
+
+        // Written with the parallel encoder, level 0 (store) to 9
+        void write_png(std::string const &filename, bool srgb = false,
+                       bool dither = false, int level = 6) const;
         void read_png(std::string const &filename);
 
     private:
-        inline unsigned index(unsigned x, unsigned y) const
+        Color load(size_t idx) const;
+        void store(size_t idx, Color const &c);
+
+        static unsigned pixelSize(Format format);
+
+        inline size_t index(unsigned x, unsigned y) const
         {
-            return y * d_width + x;
+            return size_t(y) * d_width + x;
         }
 
-        inline unsigned findex(float x, float y) const
+        inline size_t findex(float x, float y) const
         {
             return index(
                 static_cast<unsigned>(x * (d_width - 1)),
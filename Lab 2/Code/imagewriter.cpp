@@ -0,0 +1,356 @@
+#include "imagewriter.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+using namespace std;
+
+namespace
+{
+    // Unbuffered stream buffer over C's stdout. That stays on standard
+    // output when main points cout at standard error for the messages.
+    class StdoutBuffer: public streambuf
+    {
+        protected:
+            virtual int overflow(int c)
+            {
+                return c == EOF ? 0 : fputc(c, stdout);
+            }
+
+            virtual streamsize xsputn(char const *data, streamsize n)
+            {
+                return fwrite(data, 1, n, stdout);
+            }
+
+            virtual int sync()
+            {
+                return fflush(stdout) == 0 ? 0 : -1;
+            }
+    };
+
+    // "-" (or "-.y4m" etc.) is the process's standard output as it is,
+    // whether a terminal, pipe, socket or file opened for appending
+    void openOutput(filebuf &file, ostream &out, string const &filename)
+    {
+        static StdoutBuffer stdoutBuffer;
+        if (filename == "-" || filename.compare(0, 2, "-.") == 0)
+            out.rdbuf(&stdoutBuffer);
+        else
+            out.rdbuf(file.open(filename, ios::out | ios::binary | ios::trunc));
+    }
+
+    // false if anything failed to be written
+    bool closeOutput(filebuf &file, ostream &out)
+    {
+        out.flush();
+        if (file.is_open() && !file.close())
+            out.setstate(ios::failbit);
+        return !out.fail();
+    }
+}
+
+bool ImageWriter::isStream() const
+{
+    return false;
+}
+
+unsigned ImageWriter::width() const
+{
+    return d_width;
+}
+
+unsigned ImageWriter::height() const
+{
+    return d_height;
+}
+
+// --- PNG ---------------------------------------------------------------------
+
+PNGWriter::PNGWriter(int level, unsigned threads, bool srgb, bool dither)
+:
+    d_encoder(level, threads),
+    d_srgb(srgb),
+    d_dither(dither)
+{}
+
+bool PNGWriter::open(string const &filename, unsigned width, unsigned height)
+{
+    d_width = width;
+    d_height = height;
+    // alpha is always 1, so the PNG is written as RGB
+    return d_encoder.open(filename, width, height, false);
+}
+
+void PNGWriter::write(Image const &band, unsigned y0)
+{
+    band.toRGBA8(d_rgba, d_srgb, d_dither, y0);
+    d_encoder.addRows(d_rgba.data(), band.height());
+}
+
+bool PNGWriter::close()
+{
+    return d_encoder.close();
+}
+
+// --- PFM ---------------------------------------------------------------------
+
+bool PFMWriter::open(string const &filename, unsigned width, unsigned height)
+{
+    d_out.open(filename, ios::binary | ios::trunc);
+    d_width = width;
+    d_height = height;
+    d_rows = 0;
+
+    // A negative scale means little endian floats
+    d_out << "PF\n" << width << ' ' << height << "\n-1.0\n";
+    d_header = d_out.tellp();
+    return bool(d_out);
+}
+
+void PFMWriter::write(Image const &band, unsigned y0)
+{
+    vector<float> buffer;
+    size_t rowBytes = size_t(d_width) * 3 * sizeof(float);
+    for (unsigned y = 0; y != band.height(); ++y)
+    {
+        // bottom row first
+        d_out.seekp(d_header + streamoff(d_height - 1 - (y0 + y)) * rowBytes);
+        d_out.write(reinterpret_cast<char const *>(band.floatRow(y, buffer)), rowBytes);
+    }
+    d_rows += band.height();
+}
+
+bool PFMWriter::close()
+{
+    d_out.close();
+    return d_rows == d_height && !d_out.fail();
+}
+
+// --- EXR ---------------------------------------------------------------------
+
+namespace
+{
+    enum PixelType
+    {
+        EXR_HALF = 1,
+        EXR_FLOAT = 2
+    };
+
+    template <typename T>
+    void put(ostream &out, T value)
+    {
+        out.write(reinterpret_cast<char const *>(&value), sizeof(T));
+    }
+
+    // name, type, size and value of a header attribute
+    void attribute(ostream &out, char const *name, char const *type,
+                   string const &value)
+    {
+        out.write(name, strlen(name) + 1);
+        out.write(type, strlen(type) + 1);
+        put<int32_t>(out, value.size());
+        out << value;
+    }
+
+    string box2i(unsigned width, unsigned height)
+    {
+        ostringstream value;
+        put<int32_t>(value, 0);
+        put<int32_t>(value, 0);
+        put<int32_t>(value, width - 1);
+        put<int32_t>(value, height - 1);
+        return value.str();
+    }
+}
+
+EXRWriter::EXRWriter(bool half)
+:
+    d_half(half)
+{}
+
+bool EXRWriter::open(string const &filename, unsigned width, unsigned height)
+{
+    d_out.open(filename, ios::binary | ios::trunc);
+    d_width = width;
+    d_height = height;
+    d_rows = 0;
+
+    // 1. Magic number and version 2, single part scanline file.
+    put<uint32_t>(d_out, 20000630);
+    put<uint32_t>(d_out, 2);
+
+    // 2. Header, channels in alphabetical order.
+    ostringstream channels;
+    for (char const *name : {"B", "G", "R"})
+    {
+        channels.write(name, 2);
+        put<int32_t>(channels, d_half ? EXR_HALF : EXR_FLOAT);
+        put<uint32_t>(channels, 0);         // pLinear and reserved
+        put<int32_t>(channels, 1);          // x sampling
+        put<int32_t>(channels, 1);          // y sampling
+    }
+    channels.put(0);
+
+    ostringstream value;
+    attribute(d_out, "channels", "chlist", channels.str());
+    attribute(d_out, "compression", "compression", string(1, 0));
+    attribute(d_out, "dataWindow", "box2i", box2i(width, height));
+    attribute(d_out, "displayWindow", "box2i", box2i(width, height));
+    attribute(d_out, "lineOrder", "lineOrder", string(1, 0));
+    put<float>(value, 1);
+    attribute(d_out, "pixelAspectRatio", "float", value.str());
+    value.str("");
+    put<float>(value, 0);
+    put<float>(value, 0);
+    attribute(d_out, "screenWindowCenter", "v2f", value.str());
+    value.str("");
+    put<float>(value, 1);
+    attribute(d_out, "screenWindowWidth", "float", value.str());
+    d_out.put(0);
+
+    // 3. Offset table, every line has the same size.
+    uint64_t lineBytes = 8 + uint64_t(width) * 3 * (d_half ? 2 : 4);
+    uint64_t offset = uint64_t(d_out.tellp()) + 8 * uint64_t(height);
+    for (unsigned y = 0; y != height; ++y)
+        put<uint64_t>(d_out, offset + y * lineBytes);
+    return bool(d_out);
+}
+
+void EXRWriter::write(Image const &band, unsigned y0)
+{
+    // Lines hold all blue, then all green, then all red samples
+    unsigned sampleSize = d_half ? 2 : 4;
+    vector<float> buffer;
+    vector<unsigned char> line(size_t(d_width) * 3 * sampleSize);
+    for (unsigned y = 0; y != band.height(); ++y)
+    {
+        unsigned char const *src = d_half ? band.rawRow(y)
+            : reinterpret_cast<unsigned char const *>(band.floatRow(y, buffer));
+        unsigned stride = 3 * sampleSize;
+
+        for (unsigned c = 0; c != 3; ++c)
+        {
+            unsigned char *dst = &line[size_t(c) * d_width * sampleSize];
+            unsigned char const *channel = src + (2 - c) * sampleSize;
+            for (unsigned x = 0; x != d_width; ++x)
+                memcpy(dst + x * sampleSize, channel + x * stride, sampleSize);
+        }
+
+        put<int32_t>(d_out, y0 + y);
+        put<int32_t>(d_out, line.size());
+        d_out.write(reinterpret_cast<char const *>(line.data()), line.size());
+    }
+    d_rows += band.height();
+}
+
+bool EXRWriter::close()
+{
+    d_out.close();
+    return d_rows == d_height && !d_out.fail();
+}
+
+// --- Raw RGB -----------------------------------------------------------------
+
+RawWriter::RawWriter(bool srgb, bool dither)
+:
+    d_out(nullptr),
+    d_srgb(srgb),
+    d_dither(dither)
+{}
+
+bool RawWriter::open(string const &filename, unsigned width, unsigned height)
+{
+    openOutput(d_file, d_out, filename);
+    d_width = width;
+    d_height = height;
+    d_rows = 0;
+    return bool(d_out);
+}
+
+void RawWriter::write(Image const &band, unsigned y0)
+{
+    band.toRGBA8(d_rgba, d_srgb, d_dither, y0);
+    d_rgb.resize(d_rgba.size() / 4 * 3);
+    for (size_t i = 0; i != d_rgba.size() / 4; ++i)
+        memcpy(&d_rgb[3 * i], &d_rgba[4 * i], 3);
+
+    // flushed so a consumer on the other end of a pipe can start
+    d_out.write(reinterpret_cast<char const *>(d_rgb.data()), d_rgb.size());
+    d_out.flush();
+    d_rows += band.height();
+}
+
+bool RawWriter::close()
+{
+    return closeOutput(d_file, d_out) && d_rows != 0 && d_rows % d_height == 0;
+}
+
+bool RawWriter::isStream() const
+{
+    return true;
+}
+
+// --- YUV4MPEG2 ---------------------------------------------------------------
+
+Y4MWriter::Y4MWriter(unsigned frameRate, bool srgb, bool dither)
+:
+    d_out(nullptr),
+    d_srgb(srgb),
+    d_dither(dither),
+    d_frameRate(frameRate)
+{}
+
+bool Y4MWriter::open(string const &filename, unsigned width, unsigned height)
+{
+    openOutput(d_file, d_out, filename);
+    d_width = width;
+    d_height = height;
+    d_rows = 0;
+    d_chroma.resize(2 * size_t(width) * height);
+
+    d_out << "YUV4MPEG2 W" << width << " H" << height << " F" << d_frameRate
+          << ":1 Ip A1:1 C444\n";
+    return bool(d_out);
+}
+
+void Y4MWriter::write(Image const &band, unsigned y0)
+{
+    if (y0 == 0)
+        d_out << "FRAME\n";
+
+    // 1. Convert to Y'CbCr, 8 bit BT.601 studio range.
+    band.toRGBA8(d_rgba, d_srgb, d_dither, y0);
+    size_t n = d_rgba.size() / 4;
+    size_t plane = size_t(d_width) * d_height;
+    unsigned char *cb = &d_chroma[size_t(y0) * d_width];
+    unsigned char *cr = cb + plane;
+    d_luma.resize(n);
+    for (size_t i = 0; i != n; ++i)
+    {
+        int r = d_rgba[4 * i];
+        int g = d_rgba[4 * i + 1];
+        int b = d_rgba[4 * i + 2];
+        d_luma[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        cb[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        cr[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+
+    // 2. Luma rows go out right away, chroma once the frame is done.
+    d_out.write(reinterpret_cast<char const *>(d_luma.data()), n);
+    if (y0 + band.height() == d_height)
+        d_out.write(reinterpret_cast<char const *>(d_chroma.data()), d_chroma.size());
+    d_out.flush();
+    d_rows += band.height();
+}
+
+bool Y4MWriter::close()
+{
+    return closeOutput(d_file, d_out) && d_rows != 0 && d_rows % d_height == 0;
+}
+
+bool Y4MWriter::isStream() const
+{
+    return true;
+}
@@ -0,0 +1,134 @@
+#ifndef IMAGEWRITER_H_
+#define IMAGEWRITER_H_
+
+#include "image.h"
+#include "pngencoder.h"
+
+#include <fstream>
+#include <ostream>
+#include <string>
+
+// Writes an image band by band: open() with the full size, then the bands
+// from top to bottom, then close(). The whole image is just one band.
+// Stream formats (raw and y4m) take several frames in a row: y0 starts
+// over at 0 for every frame, and "-" writes them to standard output.
+class ImageWriter
+{
+    protected:
+        unsigned d_width = 0;
+        unsigned d_height = 0;
+
+    public:
+        virtual ~ImageWriter() = default;
+
+        virtual bool open(std::string const &filename, unsigned width,
+                          unsigned height) = 0;
+
+        // next rows, starting at image row y0
+        virtual void write(Image const &band, unsigned y0) = 0;
+
+        // false if rows are missing or writing failed
+        virtual bool close() = 0;
+
+        // whether more than one frame can be written
+        virtual bool isStream() const;
+
+        unsigned width() const;
+        unsigned height() const;
+};
+
+// 8 bit PNG, values are clamped to [0, 1]
+class PNGWriter: public ImageWriter
+{
+    PNGEncoder d_encoder;
+    bool d_srgb;
+    bool d_dither;
+    std::vector<unsigned char> d_rgba;
+
+    public:
+        PNGWriter(int level, unsigned threads, bool srgb, bool dither);
+
+        virtual bool open(std::string const &filename, unsigned width,
+                          unsigned height);
+        virtual void write(Image const &band, unsigned y0);
+        virtual bool close();
+};
+
+// Portable float map: linear 32 bit float RGB, not clamped. Rows are
+// stored bottom to top, so bands are written at their final offset.
+class PFMWriter: public ImageWriter
+{
+    std::ofstream d_out;
+    unsigned d_rows;
+    std::streamoff d_header;
+
+    public:
+        virtual bool open(std::string const &filename, unsigned width,
+                          unsigned height);
+        virtual void write(Image const &band, unsigned y0);
+        virtual bool close();
+};
+
+// OpenEXR scanline image, uncompressed linear RGB, not clamped. Samples are
+// 32 bit floats, or half floats copied as is from RGB16F bands.
+class EXRWriter: public ImageWriter
+{
+    std::ofstream d_out;
+    unsigned d_rows;
+    bool d_half;
+
+    public:
+        explicit EXRWriter(bool half);
+
+        virtual bool open(std::string const &filename, unsigned width,
+                          unsigned height);
+        virtual void write(Image const &band, unsigned y0);
+        virtual bool close();
+};
+
+// Raw 8 bit RGB frames (rgb24) without any header, flushed per band
+class RawWriter: public ImageWriter
+{
+    std::filebuf d_file;            // unless on standard output
+    std::ostream d_out;
+    bool d_srgb;
+    bool d_dither;
+    unsigned d_rows;
+    std::vector<unsigned char> d_rgba;
+    std::vector<unsigned char> d_rgb;
+
+    public:
+        RawWriter(bool srgb, bool dither);
+
+        virtual bool open(std::string const &filename, unsigned width,
+                          unsigned height);
+        virtual void write(Image const &band, unsigned y0);
+        virtual bool close();
+        virtual bool isStream() const;
+};
+
+// YUV4MPEG2 video, 4:4:4 BT.601 studio range. The luma plane is flushed
+// per band, the chroma planes follow when the frame is complete.
+class Y4MWriter: public ImageWriter
+{
+    std::filebuf d_file;            // unless on standard output
+    std::ostream d_out;
+    bool d_srgb;
+    bool d_dither;
+    unsigned d_frameRate;
+    unsigned d_rows;
+    std::vector<unsigned char> d_rgba;
+    std::vector<unsigned char> d_luma;      // one band
+    std::vector<unsigned char> d_chroma;    // Cb then Cr plane of a frame
+
+    public:
+        Y4MWriter(unsigned frameRate, bool srgb, bool dither);
+
+        virtual bool open(std::string const &filename, unsigned width,
+                          unsigned height);
+        virtual void write(Image const &band, unsigned y0);
+        virtual bool close();
+        virtual bool isStream() const;
+};
+
+#endif
@@ -3,10 +3,9 @@
 
 #include "triple.h"
 
-// Declare LightPtr for use in Scene class
-#include <memory>
+// Declare LightPtr for use in Scene class, lights live in the scene Arena
 class Light;
-typedef std::shared_ptr<Light> LightPtr;
+typedef Light *LightPtr;
 
 class Light
 {
@@ -1,44 +1,102 @@
 #include "raytracer.h"
+#include "imagewriter.h"
 
 #include <iostream>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 using namespace std;
 
-int main(int argc, char *argv[])
+static bool isScene(string const &name)
 {
-    cout << "Introduction to Computer Graphics - Raytracer\n\n";
+    return name.size() > 5 && name.compare(name.size() - 5, 5, ".json") == 0;
+}
 
-    if (argc < 2 || argc > 3)
+int main(int argc, char *argv[])
+{
+    // "--option value" overrides a setting, every .json argument is a
+    // frame, and a final other argument is the output
+    vector<pair<string, string>> overrides;
+    vector<string> ifnames;
+    for (int arg = 1; arg < argc; ++arg)
     {
-        cerr << "Usage: " << argv[0] << "in-file [out-file.png]\n";
-        return 1;
+        string name = argv[arg];
+        if (name.compare(0, 2, "--") == 0 && arg + 1 < argc)
+            overrides.push_back(make_pair(name.substr(2), argv[++arg]));
+        else
+            ifnames.push_back(name);
     }
+    string ofname;
+    if (ifnames.size() >= 2 && !isScene(ifnames.back()))
+    {
+        ofname = ifnames.back();
+        ifnames.pop_back();
+    }
+
+    // Frames on standard output, so the messages go to standard error
+    if (ofname == "-" || ofname.compare(0, 2, "-.") == 0)
+        cout.rdbuf(cerr.rdbuf());
 
-    Raytracer raytracer;
+    cout << "Introduction to Computer Graphics - Raytracer\n\n";
 
-    // read the scene
-    if (!raytracer.readScene(argv[1]))
+    if (ifnames.empty())
     {
-        cerr << "Error: reading scene from " << argv[1] <<
-            " failed - no output generated.\n";
+        cerr << "Usage: " << argv[0]
+             << " [--setting value ...] in-file [in-file ...] [out-file]\n";
         return 1;
     }
 
-    // determine output name
-    string ofname;
-    if (argc >= 3)
+    unique_ptr<ImageWriter> writer;
+    for (string const &ifname : ifnames)
     {
-        ofname = argv[2];   // use the provided name
+        Raytracer raytracer;
+        for (auto const &option : overrides)
+            raytracer.overrideSetting(option.first, option.second);
+
+        // read the scene
+        if (!raytracer.readScene(ifname))
+        {
+            cerr << "Error: reading scene from " << ifname <<
+                " failed - no output generated.\n";
+            return 1;
+        }
+
+        // the first frame opens the output, in its own format and size
+        if (!writer)
+        {
+            // determine output name
+            if (ofname.empty())
+            {
+                ofname = ifnames[0];    // replace .json with the format
+                ofname.erase(ofname.begin() + ofname.find_last_of('.'), ofname.end());
+                ofname += "." + raytracer.outputExtension();
+            }
+
+            writer.reset(raytracer.createWriter(ofname));
+            if (!writer)
+            {
+                cerr << "Error: cannot write " << ofname << '\n';
+                return 1;
+            }
+            if (ifnames.size() > 1 && !writer->isStream())
+            {
+                cerr << "Error: several frames need a .rgb or .y4m output.\n";
+                return 1;
+            }
+            cout << "Writing to " << ofname << "...\n";
+        }
+
+        if (!raytracer.render(*writer, ofname))
+            return 1;
     }
-    else
+
+    if (!writer->close())
     {
-        ofname = argv[1];   // replace .json with .png
-        ofname.erase(ofname.begin() + ofname.find_last_of('.'), ofname.end());
-        ofname += ".png";
+        cerr << "Error writing " << ofname << '\n';
+        return 1;
     }
-
-    raytracer.renderToFile(ofname);
-
+    cout << "Done.\n";
     return 0;
 }
@@ -0,0 +1,68 @@
+#include "mappedfile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+MappedFile::MappedFile()
+:
+    d_data(nullptr),
+    d_size(0)
+{}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(string const &filename)
+{
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void *data = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+    ::close(fd);    // the mapping keeps its own reference
+    if (data == MAP_FAILED)
+        return false;
+
+    d_data = data;
+    d_size = info.st_size;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (d_data)
+        munmap(d_data, d_size);
+    d_data = nullptr;
+    d_size = 0;
+}
+
+bool MappedFile::isOpen() const
+{
+    return d_data != nullptr;
+}
+
+char *MappedFile::data() const
+{
+    return static_cast<char *>(d_data);
+}
+
+size_t MappedFile::size() const
+{
+    return d_size;
+}
@@ -0,0 +1,29 @@
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+#include <cstddef>
+#include <string>
+
+// Read-only memory mapping of a whole file. Pages are private, writes to
+// the mapping never reach the file.
+class MappedFile
+{
+    void *d_data;
+    size_t d_size;
+
+    public:
+        MappedFile();
+        ~MappedFile();
+
+        MappedFile(MappedFile const &other) = delete;
+        MappedFile &operator=(MappedFile const &other) = delete;
+
+        bool open(std::string const &filename);
+        void close();
+
+        bool isOpen() const;
+        char *data() const;
+        size_t size() const;
+};
+
+#endif
@@ -3,6 +3,11 @@
 
 #include "triple.h"
 
+#include <cstdint>
+
+// Index into the material table of the scene, see Scene::addMaterial
+typedef uint16_t MaterialId;
+
 class Material
 {
     public:
@@ -11,6 +16,9 @@ class Material
         double kd;          // diffuse intensity
         double ks;          // specular intensity
         double n;           // exponent for specular highlight size
+        double reflect = 0.0;   // mirror reflection weight
+        double refract = 0.0;   // transmission weight, split by Fresnel
+        double eta = 1.0;       // index of refraction
 
         Material() = default;
 
@@ -22,6 +30,20 @@ class Material
             ks(ks),
             n(n)
         {}
+
+        bool operator<(Material const &other) const
+        {
+            for (unsigned i = 0; i != 3; ++i)
+                if (color.data[i] != other.color.data[i])
+                    return color.data[i] < other.color.data[i];
+            if (ka != other.ka) return ka < other.ka;
+            if (kd != other.kd) return kd < other.kd;
+            if (ks != other.ks) return ks < other.ks;
+            if (n != other.n) return n < other.n;
+            if (reflect != other.reflect) return reflect < other.reflect;
+            if (refract != other.refract) return refract < other.refract;
+            return eta < other.eta;
+        }
 };
 
 #endif
@@ -0,0 +1,66 @@
+#ifndef MORTON_H_
+#define MORTON_H_
+
+#include <cstdint>
+#include <utility>
+
+// Spread the lower 10 bits of v so there are two zero bits between each
+inline uint32_t mortonSpread3(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8))  & 0x0300f00f;
+    v = (v | (v << 4))  & 0x030c30c3;
+    v = (v | (v << 2))  & 0x09249249;
+    return v;
+}
+
+// 30 bit Morton (Z-order) code of a point on a 1024^3 grid
+inline uint32_t morton3(uint32_t x, uint32_t y, uint32_t z)
+{
+    return (mortonSpread3(x) << 2) | (mortonSpread3(y) << 1) | mortonSpread3(z);
+}
+
+// Spread the lower 16 bits of v so there is a zero bit between each
+inline uint32_t mortonSpread2(uint32_t v)
+{
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// 32 bit Morton (Z-order) code of a point on a 65536^2 grid
+inline uint32_t morton2(uint32_t x, uint32_t y)
+{
+    return (mortonSpread2(y) << 1) | mortonSpread2(x);
+}
+
+// Distance of (x, y) along the Hilbert curve through a 2^bits square
+// (bits at most 16). Unlike Z-order, consecutive points are neighbours.
+inline uint32_t hilbert2(unsigned bits, uint32_t x, uint32_t y)
+{
+    uint32_t d = 0;
+    for (uint32_t s = (1u << bits) >> 1; s != 0; s >>= 1)
+    {
+        uint32_t rx = (x & s) ? 1 : 0;
+        uint32_t ry = (y & s) ? 1 : 0;
+        d += s * s * ((3 * rx) ^ ry);
+
+        // rotate the quadrant so the curve inside it starts at its corner
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = s - 1 - (x & (s - 1));
+                y = s - 1 - (y & (s - 1));
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef OBJECT_H_
 #define OBJECT_H_
 
+#include "aabb.h"
 #include "material.h"
 
 // not really needed here, but deriving classes may need them
@@ -8,19 +9,30 @@
 #include "ray.h"
 #include "triple.h"
 
-#include <memory>
+// Objects are owned by the Arena of their Scene, which releases them all
+// at once. ObjectPtr is therefore a plain, non-owning pointer.
 class Object;
-typedef std::shared_ptr<Object> ObjectPtr;
+typedef Object *ObjectPtr;
 
 class Object
 {
     public:
-        Material material;
-
-        virtual ~Object() = default;
+        MaterialId material;    // index into the scene's material table
+        unsigned id = 0;        // of the scene file object, from 1
 
         virtual Hit intersect(Ray const &ray) = 0;  // must be implemented
                                                     // in derived class
+
+        // World space bounds, unbounded shapes keep the default
+        virtual AABB bounds() const
+        {
+            return AABB::infinite();
+        }
+
+    protected:
+        // Never deleted through an Object *, which keeps plain shapes
+        // trivially destructible (the Arena then skips them on release)
+        ~Object() = default;
 };
 
 #endif
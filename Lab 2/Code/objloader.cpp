@@ -22,6 +22,15 @@ OBJLoader::OBJLoader(string const &filename)
     parseFile(filename);
 }
 
+OBJLoader::OBJLoader(string const &filename,
+                     function<void(Vertex const &)> const &onVertex)
+:
+    d_hasTexCoords(false),
+    d_onVertex(onVertex)
+{
+    parseFile(filename);
+}
+
 // ===================================================================
 // -- Member functions -----------------------------------------------
 // ===================================================================
@@ -34,33 +43,7 @@ vector<Vertex> OBJLoader::vertex_data() const
 
     // For all vertices in the model, interleave the data
     for (Vertex_idx const &vertex : d_vertices)
-    {
-        // Add coordinate data
-        Vertex vert;
-
-        vec3 const coord = d_coordinates.at(vertex.d_coord);
-        vert.x = coord.x;
-        vert.y = coord.y;
-        vert.z = coord.z;
-
-        // Add normal data
-        vec3 const norm = d_normals.at(vertex.d_norm);
-        vert.nx = norm.x;
-        vert.ny = norm.y;
-        vert.nz = norm.z;
-
-        // Add texture data (if available)
-        if (d_hasTexCoords)
-        {
-            vec2 const tex = d_texCoords.at(vertex.d_tex);
-            vert.u = tex.u;      // u coordinate
-            vert.v = tex.v;      // v coordinate
-        } else {
-            vert.u = 0;
-            vert.v = 0;
-        }
-        data.push_back(vert);
-    }
+        data.push_back(interleave(vertex));
 
     return data;    // copy elision
 }
@@ -186,8 +169,40 @@ void OBJLoader::parseFace(StringList const &tokens)
 
         vertex.d_norm = stoul(elements.at(2)) - 1U;
 
-        d_vertices.push_back(vertex);
+        if (d_onVertex)
+            d_onVertex(interleave(vertex));
+        else
+            d_vertices.push_back(vertex);
+    }
+}
+
+Vertex OBJLoader::interleave(Vertex_idx const &vertex) const
+{
+    // Add coordinate data
+    Vertex vert;
+
+    vec3 const coord = d_coordinates.at(vertex.d_coord);
+    vert.x = coord.x;
+    vert.y = coord.y;
+    vert.z = coord.z;
+
+    // Add normal data
+    vec3 const norm = d_normals.at(vertex.d_norm);
+    vert.nx = norm.x;
+    vert.ny = norm.y;
+    vert.nz = norm.z;
+
+    // Add texture data (if available)
+    if (d_hasTexCoords)
+    {
+        vec2 const tex = d_texCoords.at(vertex.d_tex);
+        vert.u = tex.u;      // u coordinate
+        vert.v = tex.v;      // v coordinate
+    } else {
+        vert.u = 0;
+        vert.v = 0;
     }
+    return vert;
 }
 
 OBJLoader::StringList OBJLoader::split(string const &line,
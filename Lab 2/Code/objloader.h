@@ -7,12 +7,14 @@
 
 #include "vertex.h"
 
+#include <functional>
 #include <string>
 #include <vector>
 
 class OBJLoader
 {
     bool d_hasTexCoords;
+    std::function<void(Vertex const &)> d_onVertex;
 
     struct vec3
     {
@@ -56,6 +58,15 @@ class OBJLoader
          */
         explicit OBJLoader(std::string const &filename);
 
+        /**
+         * @brief OBJLoader that streams the faces
+         * @param filename
+         * @param onVertex called with every face vertex, in file order,
+         *  instead of storing it. vertex_data() is then empty.
+         */
+        OBJLoader(std::string const &filename,
+                  std::function<void(Vertex const &)> const &onVertex);
+
         /**
          * @brief vertex_data
          * @return interleaved vertex data, see vertex.h
@@ -85,6 +96,8 @@ class OBJLoader
         void parseTexCoord(StringList const &tokens);
         void parseFace(StringList const &tokens);
 
+        Vertex interleave(Vertex_idx const &vertex) const;
+
         StringList split(std::string const &str,
                              char splitChar,
                              bool keepEmpty = true);
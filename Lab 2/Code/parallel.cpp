@@ -0,0 +1,90 @@
+#include "parallel.h"
+
+using namespace std;
+
+namespace
+{
+    thread_local bool t_inTask = false;     // running a pool task
+}
+
+ThreadPool &ThreadPool::instance()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+ThreadPool::ThreadPool()
+:
+    d_task(nullptr),
+    d_generation(0),
+    d_wanted(0),
+    d_busy(0),
+    d_stop(false)
+{}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(d_lock);
+        d_stop = true;
+    }
+    d_wake.notify_all();
+    for (thread &worker : d_workers)
+        worker.join();
+}
+
+void ThreadPool::run(function<void()> const &task, unsigned helpers)
+{
+    // Nested or concurrent calls: the task's shared counter lets a single
+    // thread do all of the work.
+    unique_lock<mutex> running(d_runLock, try_to_lock);
+    if (t_inTask || !running.owns_lock())
+    {
+        task();
+        return;
+    }
+
+    // 1. Start more workers if needed, they wait for the next generation.
+    {
+        lock_guard<mutex> lock(d_lock);
+        while (d_workers.size() < helpers)
+            d_workers.emplace_back(&ThreadPool::work, this,
+                                   unsigned(d_workers.size()), d_generation);
+        d_task = &task;
+        d_wanted = helpers;
+        d_busy = helpers;
+        ++d_generation;
+    }
+    d_wake.notify_all();
+
+    // 2. Take part, then wait for the helpers to finish.
+    t_inTask = true;
+    task();
+    t_inTask = false;
+
+    unique_lock<mutex> lock(d_lock);
+    d_done.wait(lock, [&]{ return d_busy == 0; });
+    d_task = nullptr;
+}
+
+void ThreadPool::work(unsigned id, uint64_t generation)
+{
+    t_inTask = true;
+    unique_lock<mutex> lock(d_lock);
+    for (;;)
+    {
+        d_wake.wait(lock, [&]{ return d_stop || d_generation != generation; });
+        if (d_stop)
+            return;
+        generation = d_generation;
+        if (id >= d_wanted)
+            continue;
+
+        function<void()> const *task = d_task;
+        lock.unlock();
+        (*task)();
+        lock.lock();
+        if (--d_busy == 0)
+            d_done.notify_one();
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of worker threads to use when none is configured
+inline unsigned defaultThreads()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Worker threads kept alive between parallelFor calls, so a call costs a
+// wake-up instead of creating and joining threads. Thread local caches
+// therefore also live on from one call to the next.
+class ThreadPool
+{
+    std::mutex d_lock;
+    std::mutex d_runLock;               // one task at a time
+    std::condition_variable d_wake;
+    std::condition_variable d_done;
+    std::vector<std::thread> d_workers;
+    std::function<void()> const *d_task;
+    uint64_t d_generation;              // of the current task
+    unsigned d_wanted;                  // workers taking part in it
+    unsigned d_busy;
+    bool d_stop;
+
+    public:
+        static ThreadPool &instance();
+
+        ThreadPool();
+        ~ThreadPool();
+
+        // Run task on the calling thread and on `helpers` workers at the
+        // same time, returns when all are done. Called from within a task
+        // (or while another thread runs one), task runs on the caller only.
+        void run(std::function<void()> const &task, unsigned helpers);
+
+    private:
+        void work(unsigned id, uint64_t generation);
+};
+
+// Run job(i) for every i in [0, count) on up to `threads` threads. Jobs are
+// handed out in increasing order from a shared counter, the calling thread
+// takes part as well.
+template <typename Job>
+void parallelFor(unsigned count, unsigned threads, Job job)
+{
+    std::atomic<unsigned> next(0);
+    std::function<void()> worker = [&]()
+    {
+        for (unsigned i = next++; i < count; i = next++)
+            job(i);
+    };
+
+    threads = std::max(1u, std::min(threads, count));
+    if (threads == 1)
+        worker();
+    else
+        ThreadPool::instance().run(worker, threads - 1);
+}
+
+#endif
@@ -0,0 +1,235 @@
+#include "pngencoder.h"
+
+#include "deflate.h"
+#include "parallel.h"
+#include "lode/lodepng.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+using namespace std;
+
+namespace
+{
+    unsigned char const PNG_SIGNATURE[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+    void putUint32(vector<unsigned char> &out, uint32_t value)
+    {
+        out.push_back(value >> 24);
+        out.push_back(value >> 16);
+        out.push_back(value >> 8);
+        out.push_back(value);
+    }
+
+    unsigned char paeth(int a, int b, int c)
+    {
+        int p = a + b - c;
+        int pa = abs(p - a);
+        int pb = abs(p - b);
+        int pc = abs(p - c);
+        if (pa <= pb && pa <= pc) return a;
+        return pb <= pc ? b : c;
+    }
+
+    // Apply filter type to one scanline (prev is zeros for the first row)
+    void filterRow(unsigned char *out, unsigned char const *row,
+                   unsigned char const *prev, size_t length, unsigned bpp,
+                   unsigned type)
+    {
+        for (size_t i = 0; i != length; ++i)
+        {
+            int a = i >= bpp ? row[i - bpp] : 0;
+            int b = prev[i];
+            int c = i >= bpp ? prev[i - bpp] : 0;
+            switch (type)
+            {
+                case 0: out[i] = row[i]; break;
+                case 1: out[i] = row[i] - a; break;
+                case 2: out[i] = row[i] - b; break;
+                case 3: out[i] = row[i] - ((a + b) >> 1); break;
+                default: out[i] = row[i] - paeth(a, b, c); break;
+            }
+        }
+    }
+
+    // Copy the first `channels` channels of an RGBA row
+    void extractRow(unsigned char *dst, unsigned char const *rgba,
+                    unsigned width, unsigned channels)
+    {
+        for (unsigned x = 0; x != width; ++x)
+            for (unsigned c = 0; c != channels; ++c)
+                dst[x * channels + c] = rgba[4 * x + c];
+    }
+}
+
+PNGEncoder::PNGEncoder(int level, unsigned threads)
+:
+    d_level(level),
+    d_threads(threads == 0 ? defaultThreads() : threads),
+    d_width(0),
+    d_height(0),
+    d_channels(0),
+    d_rows(0),
+    d_adler(1)
+{}
+
+bool PNGEncoder::open(string const &filename, unsigned width, unsigned height,
+                      bool alpha)
+{
+    d_out.open(filename, ios::binary | ios::trunc);
+    d_width = width;
+    d_height = height;
+    d_channels = alpha ? 4 : 3;
+    d_rows = 0;
+    d_prevRow.assign(size_t(width) * d_channels, 0);
+    d_window.clear();
+    d_adler = 1;
+
+    unsigned char ihdr[13];
+    ihdr[0] = width >> 24;
+    ihdr[1] = width >> 16;
+    ihdr[2] = width >> 8;
+    ihdr[3] = width;
+    ihdr[4] = height >> 24;
+    ihdr[5] = height >> 16;
+    ihdr[6] = height >> 8;
+    ihdr[7] = height;
+    ihdr[8] = 8;                            // bit depth
+    ihdr[9] = alpha ? 6 : 2;                // RGBA or RGB
+    ihdr[10] = 0;                           // deflate
+    ihdr[11] = 0;                           // adaptive filtering
+    ihdr[12] = 0;                           // no interlacing
+
+    d_out.write(reinterpret_cast<char const *>(PNG_SIGNATURE), sizeof(PNG_SIGNATURE));
+    putChunk("IHDR", ihdr, sizeof(ihdr));
+    return bool(d_out);
+}
+
+void PNGEncoder::addRows(unsigned char const *rgba, unsigned rows)
+{
+    rows = min(rows, d_height - d_rows);
+    if (rows == 0)
+        return;
+    bool last = d_rows + rows == d_height;
+
+    // 1. Filter the rows, behind the dictionary from the previous band.
+    vector<unsigned char> filtered(d_window);
+    size_t begin = filtered.size();
+    filter(filtered, rgba, rows);
+    size_t size = filtered.size() - begin;
+
+    // 2. Deflate the chunks and checksum them, all independently.
+    unsigned numChunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    vector<vector<unsigned char>> deflated(numChunks);
+    vector<uint32_t> adlers(numChunks);
+    parallelFor(numChunks, d_threads, [&](unsigned i)
+    {
+        size_t from = begin + size_t(i) * CHUNK_SIZE;
+        size_t to = min(filtered.size(), from + CHUNK_SIZE);
+        deflateChunk(filtered.data(), from, to, last && i + 1 == numChunks,
+                     d_level, deflated[i]);
+        adlers[i] = adler32(filtered.data() + from, to - from);
+    });
+
+    // 3. Append them to the zlib stream, as one IDAT chunk per band.
+    vector<unsigned char> idat;
+    if (d_rows == 0)
+    {
+        idat.push_back(0x78);               // deflate, 32 KiB window
+        idat.push_back(d_level == 0 ? 0x01 : d_level < 6 ? 0x5e : d_level == 6 ? 0x9c : 0xda);
+    }
+    for (unsigned i = 0; i != numChunks; ++i)
+    {
+        idat.insert(idat.end(), deflated[i].begin(), deflated[i].end());
+        size_t from = size_t(i) * CHUNK_SIZE;
+        d_adler = adler32Combine(d_adler, adlers[i], min(size - from, size_t(CHUNK_SIZE)));
+        vector<unsigned char>().swap(deflated[i]);
+    }
+    if (last)
+        putUint32(idat, d_adler);
+    putChunk("IDAT", idat.data(), idat.size());
+
+    // 4. Keep what the next band needs.
+    d_window.assign(filtered.end() - min(filtered.size(), size_t(WINDOW_BYTES)),
+                    filtered.end());
+    extractRow(d_prevRow.data(), rgba + size_t(rows - 1) * d_width * 4,
+               d_width, d_channels);
+    d_rows += rows;
+}
+
+bool PNGEncoder::close()
+{
+    if (!d_out.is_open())
+        return false;
+    bool complete = d_rows == d_height;
+    putChunk("IEND", nullptr, 0);
+    d_out.close();
+    return complete && !d_out.fail();
+}
+
+bool PNGEncoder::write(string const &filename, unsigned char const *rgba,
+                       unsigned width, unsigned height, bool alpha)
+{
+    if (!open(filename, width, height, alpha))
+        return false;
+    addRows(rgba, height);
+    return close();
+}
+
+void PNGEncoder::putChunk(char const *type, unsigned char const *data,
+                          size_t size)
+{
+    vector<unsigned char> chunk;
+    chunk.reserve(size + 12);
+    putUint32(chunk, size);
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data, data + size);
+    putUint32(chunk, lodepng_crc32(&chunk[4], size + 4));
+    d_out.write(reinterpret_cast<char const *>(chunk.data()), chunk.size());
+}
+
+void PNGEncoder::filter(vector<unsigned char> &out, unsigned char const *rgba,
+                        unsigned rows) const
+{
+    size_t stride = size_t(d_width) * d_channels;
+    size_t offset = out.size();
+    out.resize(offset + (stride + 1) * rows);
+
+    // Rows are independent given the unfiltered previous row
+    unsigned const ROWS_PER_JOB = 16;
+    unsigned jobs = (rows + ROWS_PER_JOB - 1) / ROWS_PER_JOB;
+    parallelFor(jobs, d_threads, [&](unsigned job)
+    {
+        vector<unsigned char> row(stride);
+        vector<unsigned char> prev(d_prevRow);
+        vector<unsigned char> trial(stride);
+        unsigned y0 = job * ROWS_PER_JOB;
+        unsigned y1 = min(rows, y0 + ROWS_PER_JOB);
+        if (y0 != 0)
+            extractRow(prev.data(), rgba + size_t(y0 - 1) * d_width * 4, d_width, d_channels);
+
+        for (unsigned y = y0; y != y1; ++y)
+        {
+            extractRow(row.data(), rgba + size_t(y) * d_width * 4, d_width, d_channels);
+
+            // Pick the filter with the smallest sum of absolute
+            // (signed) residuals, the usual heuristic
+            unsigned char *dst = &out[offset + y * (stride + 1)];
+            unsigned long bestSum = ~0ul;
+            for (unsigned type = 0; type != 5; ++type)
+            {
+                filterRow(trial.data(), row.data(), prev.data(), stride, d_channels, type);
+                unsigned long sum = 0;
+                for (unsigned char v : trial)
+                    sum += v < 128 ? v : 256 - v;
+                if (sum < bestSum)
+                {
+                    bestSum = sum;
+                    dst[0] = type;
+                    copy(trial.begin(), trial.end(), dst + 1);
+                }
+            }
+            row.swap(prev);
+        }
+    });
+}
@@ -0,0 +1,63 @@
+#ifndef PNGENCODER_H_
+#define PNGENCODER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Multithreaded PNG writer. Scanlines are filtered in parallel, then the
+// filtered image is cut into chunks that are deflated in parallel and
+// joined into a single zlib stream (see deflate.h).
+//
+// Rows can be added in bands as they are rendered: every band is
+// compressed and written out right away, so only one band is ever held
+// in memory.
+class PNGEncoder
+{
+    int d_level;
+    unsigned d_threads;
+
+    std::ofstream d_out;
+    unsigned d_width;
+    unsigned d_height;
+    unsigned d_channels;
+    unsigned d_rows;                        // rows written so far
+    std::vector<unsigned char> d_prevRow;   // last row, unfiltered
+    std::vector<unsigned char> d_window;    // last 32 KiB of filtered data
+    uint32_t d_adler;
+
+    public:
+        enum : size_t
+        {
+            CHUNK_SIZE = 128 * 1024,    // filtered bytes per deflate job
+            WINDOW_BYTES = 32 * 1024
+        };
+
+        // level: 0 (store) to 9 (smallest), threads: 0 for all cores
+        explicit PNGEncoder(int level = 6, unsigned threads = 0);
+
+        // Start a width x height image. Without alpha the image is
+        // written as RGB, dropping the alpha channel of the rows.
+        bool open(std::string const &filename, unsigned width,
+                  unsigned height, bool alpha);
+
+        // Append the next rows (8 bit RGBA, top to bottom)
+        void addRows(unsigned char const *rgba, unsigned rows);
+
+        // Finish the file, false if rows are missing or writing failed
+        bool close();
+
+        // Whole image in one go
+        bool write(std::string const &filename, unsigned char const *rgba,
+                   unsigned width, unsigned height, bool alpha);
+
+    private:
+        void putChunk(char const *type, unsigned char const *data,
+                      size_t size);
+        void filter(std::vector<unsigned char> &out, unsigned char const *rgba,
+                    unsigned rows) const;
+};
+
+#endif
@@ -1,8 +1,12 @@
 #include "raytracer.h"
 
+#include "aovs.h"
+#include "denoiser.h"
 #include "image.h"
+#include "imagewriter.h"
 #include "light.h"
 #include "material.h"
+#include "parallel.h"
 #include "triple.h"
 
 // =============================================================================
@@ -12,6 +16,7 @@
 #include "shapes/sphere.h"
 #include "shapes/triangle.h"
 #include "shapes/plane.h"
+#include "shapes/streamedmesh.h"
 #include "objloader.h"
 
 // =============================================================================
@@ -20,9 +25,15 @@
 
 #include "json/json.h"
 
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <exception>
 #include <fstream>
 #include <iostream>
+#include <memory>
 
 using namespace std;        // no std:: required
 using json = nlohmann::json;
@@ -31,11 +42,47 @@ using json = nlohmann::json;
 // -- Helper Methods for loading objects ------------------------------
 // =============================================================================
 
+// FNV-1a over a byte range, continuing from hash
+static uint64_t fnv1a(char const *data, size_t size, uint64_t hash)
+{
+    for (size_t i = 0; i != size; ++i)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Absolute path without links or dots, as given if the file is missing
+static string canonicalPath(string const &filePath)
+{
+    char *resolved = realpath(filePath.c_str(), nullptr);
+    if (!resolved)
+        return filePath;
+    string path(resolved);
+    free(resolved);
+    return path;
+}
+
+// Hash of a file's canonical path and contents, continuing from hash. Model
+// paths are relative to the working directory, so the same name can mean
+// another file when run from elsewhere.
+static uint64_t hashFile(string const &filePath, uint64_t hash)
+{
+    string path = canonicalPath(filePath);
+    hash = fnv1a(path.data(), path.size(), hash);
+    ifstream file(path, ios::binary);
+    char buffer[1 << 16];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() != 0)
+        hash = fnv1a(buffer, file.gcount(), hash);
+    return hash;
+}
+
 // Prepares a sphere object for the scene.
 void Raytracer::loadSphere (json const &node, vector<ObjectPtr> &sceneObjects) {
     Point p(node["position"]);
     double r = node["radius"];
-    sceneObjects.push_back(ObjectPtr(new Sphere(p, r)));
+    sceneObjects.push_back(scene.getArena().create<Sphere>(p, r));
 }
 
 // Prepares a triangle object for the scene.
@@ -43,14 +90,14 @@ void Raytracer::loadTriangle (json const &node, vector<ObjectPtr> &sceneObjects)
     Point a(node["point_a"]);
     Point b(node["point_b"]);
     Point c(node["point_c"]);
-    sceneObjects.push_back(ObjectPtr(new Triangle(a, b, c)));
+    sceneObjects.push_back(scene.getArena().create<Triangle>(a, b, c));
 }
 
 // Prepares a plane object for the scene.
 void Raytracer::loadPlane (json const &node, vector<ObjectPtr> &sceneObjects) {
     Point a(node["point_a"]);
     Vector n(node["normal"]);
-    sceneObjects.push_back(ObjectPtr(new Plane(a, n)));
+    sceneObjects.push_back(scene.getArena().create<Plane>(a, n));
 }
 
 // Prepares a quad object for the scene.
@@ -61,20 +108,58 @@ void Raytracer::loadQuad (json const &node, std::vector<ObjectPtr> &sceneObjects
     Point c(node["point_c"]);
     Point d(node["point_d"]);
 
-    sceneObjects.push_back(ObjectPtr(new Triangle(a, b, c)));
-    sceneObjects.push_back(ObjectPtr(new Triangle(c, b, d)));
+    sceneObjects.push_back(scene.getArena().create<Triangle>(a, b, c));
+    sceneObjects.push_back(scene.getArena().create<Triangle>(c, b, d));
 }
 
 // Prepares a model object for the scene.
 void Raytracer::loadMesh (json const &node, vector<ObjectPtr> &sceneObjects) {
-    int s = 60, dx = 300, dy = 300, dz = 100;
 
-    // 1. Obtain file name. Load in object model.
+    // Model to scene transform, scaled then moved to "position" (in single
+    // precision, like the model coordinates)
+    float s = node.count("scale") ? float(node["scale"]) : 60.0f;
+    Point offset = node.count("position") ? Point(node["position"]) : Point(300, 300, 100);
+    float dx = offset.x, dy = offset.y, dz = offset.z;
+
+    // 1. Obtain file name. Streamed meshes reuse their block file when the
+    //    model is unchanged, without parsing it again.
     string filePath = node["model"];
-    OBJLoader *model = new OBJLoader(filePath);
+    if (node.count("streamed") && node["streamed"]) {
+        string streamPath = filePath + ".stream";
+        string text = node.dump();
+        uint64_t key = hashFile(filePath, fnv1a(text.data(), text.size(), 14695981039346656037ull));
+        unsigned threads = settings.threads == 0 ? defaultThreads() : settings.threads;
+        StreamedMeshPtr mesh = scene.getArena().create<StreamedMesh>();
+        if (!mesh->open(streamPath, key, settings.memoryBudget, threads)) {
+
+            // Otherwise the faces go straight from the model file to the
+            // block file writer, nothing but the vertex list is kept.
+            StreamedMesh::Writer writer(streamPath, key, settings.memoryBudget);
+            Vertex corners[3];
+            unsigned numCorners = 0;
+            OBJLoader(filePath, [&](Vertex const &v) {
+                corners[numCorners++] = v;
+                if (numCorners != 3)
+                    return;
+                numCorners = 0;
+                float triangle[9];
+                for (unsigned i = 0; i != 3; ++i) {
+                    triangle[3 * i] = corners[i].x * s + dx;
+                    triangle[3 * i + 1] = corners[i].y * s + dy;
+                    triangle[3 * i + 2] = corners[i].z * s + dz;
+                }
+                writer.add(triangle);
+            });
+            if (!writer.finish() || !mesh->open(streamPath, key, settings.memoryBudget, threads))
+                throw runtime_error("Could not write streamed mesh " + streamPath + ".");
+        }
+        sceneObjects.push_back(mesh);
+        return;
+    }
 
-    // 2. Extract vertex data and normal data.
-    vector<Vertex> vs = model->vertex_data();
+    // 2. Load in object model. Extract vertex data and normal data.
+    OBJLoader model(filePath);
+    vector<Vertex> vs = model.vertex_data();
     for (unsigned i = 0; i < vs.size(); i += 3) {
 
         // Extract three points as type Vertex.
@@ -86,12 +171,11 @@ void Raytracer::loadMesh (json const &node, vector<ObjectPtr> &sceneObjects) {
         Point r = Triple(c.x * s + dx, c.y * s + dy, c.z * s + dz); 
         
         // Construct a triangle and push it to the scene object buffer.
-        ObjectPtr obj = ObjectPtr(new Triangle(p, q, r));
-        sceneObjects.push_back(obj);
+        sceneObjects.push_back(scene.getArena().create<Triangle>(p, q, r));
     }
 }
 
-bool Raytracer::parseObjectNode(json const &node)
+bool Raytracer::parseObjectNode(json const &node, unsigned id)
 {
     // Vector of objects to be added to the scene. 
     std::vector<ObjectPtr> sceneObjects;
@@ -118,16 +202,34 @@ bool Raytracer::parseObjectNode(json const &node)
 // =============================================================================
 
     // Parse material and add objects to the scene
-    Material material = parseMaterialNode(node["material"]);
+    MaterialId material = scene.addMaterial(parseMaterialNode(node["material"]));
     for (unsigned i = 0; i < sceneObjects.size(); i++) {
         ObjectPtr obj = sceneObjects[i];
         obj->material = material;
+        obj->id = id;
         scene.addObject(obj);
     }
 
     return true;
 }
 
+uint64_t Raytracer::geometryKey(json const &objects) const
+{
+    // 1. The objects section itself (lights and camera are excluded, so
+    //    moving those keeps the cache valid).
+    string text = objects.dump();
+    uint64_t hash = fnv1a(text.data(), text.size(), 14695981039346656037ull);
+
+    // 2. The contents of every referenced model file.
+    for (auto const &node : objects)
+    {
+        if (!node.count("model"))
+            continue;
+        hash = hashFile(node["model"], hash);
+    }
+    return hash;
+}
+
 Light Raytracer::parseLightNode(json const &node) const
 {
     Point pos(node["position"]);
@@ -142,7 +244,11 @@ Material Raytracer::parseMaterialNode(json const &node) const
     double kd = node["kd"];
     double ks = node["ks"];
     double n  = node["n"];
-    return Material(color, ka, kd, ks, n);
+    Material material(color, ka, kd, ks, n);
+    material.reflect = node.value("reflect", 0.0);
+    material.refract = node.value("refract", 0.0);
+    material.eta = node.value("eta", 1.0);
+    return material;
 }
 
 // Custom Method which maps a object--type-string to an integer. 
@@ -168,20 +274,57 @@ try
 // -- Read your scene data in this section -------------------------------------
 // =============================================================================
 
+    auto start = chrono::steady_clock::now();
+
     Point eye(jsonscene["Eye"]);
     scene.setEye(eye);
 
-    // TODO: add your other configuration settings here
+    // Rendering settings, then the command line overrides
+    if (jsonscene.count("Settings"))
+        settings.read(jsonscene["Settings"]);
+    for (auto const &option : overrides)
+        settings.set(option.first, option.second);
+
+    // Back the scene arena with huge pages, set before any object exists
+    scene.getArena().setHugePages(settings.hugePages);
+    scene.setLazyBVH(settings.lazyBVH);
+    scene.setRenderSettings(settings.threads, settings.tileSize, settings.samples,
+                            settings.sampler, settings.seed);
+    scene.setPixelOrder(settings.pixelOrder);
+    scene.setNoiseThreshold(settings.noiseThreshold);
+    scene.setEdgeThreshold(settings.edgeThreshold);
+    scene.setTraceLimits(settings.maxDepth, settings.rayBudget);
+    scene.setLightSamples(settings.lightSamples);
+    scene.setShadows(settings.shadows);
+    scene.setWavefront(settings.wavefront);
+    scene.setRaySorting(settings.sortRays);
+
+    // The built tree is cached next to the scene file unless disabled
+    if (settings.cache)
+    {
+        // scene.json -> scene.bvh, a name without extension gets one
+        string cacheFile = ifname;
+        size_t dot = cacheFile.find_last_of('.');
+        if (dot != string::npos && dot > cacheFile.find_last_of('/') + 1)
+            cacheFile.erase(dot);
+        scene.setAcceleratorCache(cacheFile + ".bvh", geometryKey(jsonscene["Objects"]));
+    }
 
     for (auto const &lightNode : jsonscene["Lights"])
         scene.addLight(parseLightNode(lightNode));
 
     unsigned objCount = 0;
     for (auto const &objectNode : jsonscene["Objects"])
-        if (parseObjectNode(objectNode))
+        if (parseObjectNode(objectNode, objCount + 1))
             ++objCount;
 
-    cout << "Parsed " << objCount << " objects.\n";
+    // Peak resident set size, ru_maxrss is in KiB on Linux
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    cout << "Parsed " << objCount << " objects in "
+         << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+         << " ms (arena " << scene.getArena().bytesUsed() / double(1 << 20)
+         << " MiB, peak RSS " << usage.ru_maxrss / 1024.0 << " MiB).\n";
 
 // =============================================================================
 // -- End of scene data reading ------------------------------------------------
@@ -195,13 +338,302 @@ catch (exception const &ex)
     return false;
 }
 
-void Raytracer::renderToFile(string const &ofname)
+bool Raytracer::render(ImageWriter &writer, string const &filename)
+{
+    if (writer.width() != settings.width || writer.height() != settings.height)
+    {
+        cerr << "Error: frame size " << settings.width << 'x' << settings.height
+             << " does not match the output (" << writer.width() << 'x'
+             << writer.height() << ").\n";
+        return false;
+    }
+
+    auto start = chrono::steady_clock::now();
+    bool cached = scene.buildAccelerator();
+    auto built = chrono::steady_clock::now();
+    cout << (cached ? "Loaded cached" : "Built") << " acceleration structure in "
+         << chrono::duration<double, milli>(built - start).count() << " ms.\n";
+
+    // Arbitrary output variables, a file each
+    AOVs aovs;
+    for (string const &name : settings.aovs)
+        aovs.select(AOVs::layer(name));
+    if (!aovs.empty())
+    {
+        if (settings.timeBudget > 0 || settings.progressive || writer.isStream()
+            || filename.empty())
+        {
+            cerr << "Error: AOVs are written for single images, not for progressive"
+                    " rendering or streams.\n";
+            return false;
+        }
+        if (!aovs.open(filename, settings.width, settings.height))
+        {
+            cerr << "Error: cannot write the AOVs of " << filename << '\n';
+            return false;
+        }
+    }
+
+    if (settings.timeBudget > 0 || settings.progressive)
+    {
+        // the passes gather no guides
+        if (settings.denoise)
+            cerr << "Note: \"Denoise\" is not applied to progressive rendering.\n";
+        return renderProgressive(writer, start);
+    }
+
+    // Without bands the whole image is traced first, then written. With
+    // bands every band is written as soon as it is traced.
+    unsigned rows = settings.bandRows == 0 ? settings.height : settings.bandRows;
+    cout << "Tracing " << (settings.height + rows - 1) / rows << " band(s) of "
+         << rows << " rows...\n";
+
+    // Adaptive sampling sums up the samples per tile for the map
+    bool adaptive = settings.edgeAA || settings.noiseThreshold > 0;
+    unsigned tilesX = (settings.width + settings.tileSize - 1) / settings.tileSize;
+    unsigned tilesY = (settings.height + settings.tileSize - 1) / settings.tileSize;
+    vector<double> tileSamples(adaptive ? tilesX * tilesY : 0);
+    vector<unsigned> counts;
+    size_t rays = 0;
+
+    // The guides of the denoiser and the AOVs are gathered per band
+    Denoiser denoiser;
+    BandOutputs outputs;
+    outputs.guides = settings.denoise ? &denoiser : nullptr;
+    outputs.aovs = aovs.empty() ? nullptr : &aovs;
+    chrono::steady_clock::duration denoising(0);
+    chrono::steady_clock::duration tracing(0);
+
+    // The denoiser reads neighbours up to Denoiser::reach() rows away, so
+    // bands are traced with that many rows of the bands above and below
+    // and filtered as in the whole image. Only their own rows are written.
+    unsigned halo = outputs.guides && rows < settings.height ? Denoiser::reach() : 0;
+    size_t haloRays = 0;
+
+    for (unsigned y0 = 0; y0 < settings.height; y0 += rows)
+    {
+        unsigned bandRows = min(rows, settings.height - y0);
+        unsigned above = min(y0, halo);
+        unsigned below = min(halo, settings.height - y0 - bandRows);
+        Image band(settings.width, above + bandRows + below, settings.framebuffer);
+        if (outputs.guides)
+            denoiser.resize(band.width(), band.height());
+        if (outputs.aovs)
+            aovs.resize(band.height());
+        auto traced = chrono::steady_clock::now();
+        if (adaptive)
+        {
+            if (settings.edgeAA)
+                scene.renderEdges(band, y0 - above, settings.height, counts, outputs);
+            else
+                scene.renderAdaptive(band, y0 - above, settings.height, counts, outputs);
+            tracing += chrono::steady_clock::now() - traced;
+            for (unsigned y = 0; y != band.height(); ++y)
+            {
+                bool own = y >= above && y < above + bandRows;
+                for (unsigned x = 0; x != band.width(); ++x)
+                {
+                    unsigned count = counts[size_t(y) * band.width() + x];
+                    if (!own)
+                    {
+                        haloRays += count;
+                        continue;
+                    }
+                    tileSamples[(y0 + y - above) / settings.tileSize * tilesX + x / settings.tileSize] += count;
+                    rays += count;
+                }
+            }
+        }
+        else
+        {
+            scene.renderBand(band, y0 - above, settings.height, outputs);
+            tracing += chrono::steady_clock::now() - traced;
+            rays += size_t(band.width()) * bandRows * settings.samples;
+            haloRays += size_t(band.width()) * (above + below) * settings.samples;
+        }
+        if (outputs.guides)
+        {
+            auto filtered = chrono::steady_clock::now();
+            denoiser.apply(band, settings.threads == 0 ? defaultThreads() : settings.threads);
+            denoising += chrono::steady_clock::now() - filtered;
+        }
+        if (halo != 0)
+            band = band.rows(above, bandRows);
+        if (settings.toneMapping)
+            band.toneMap(settings.toneMap, settings.exposure);
+        writer.write(band, y0);
+        if (outputs.aovs)
+            aovs.write(y0, above, bandRows);
+    }
+    if (outputs.aovs && !aovs.close())
+    {
+        cerr << "Error writing the AOVs of " << filename << '\n';
+        return false;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    cout << "Traced and written in "
+         << chrono::duration<double>(chrono::steady_clock::now() - built).count()
+         << " s (" << scene.getNumBVHNodes() << " BVH nodes, peak RSS "
+         << usage.ru_maxrss / 1024.0 << " MiB).\n";
+    scene.reportStreaming(cout);
+    if (scene.getNumSecondaryRays() != 0)
+        cout << "Traced " << scene.getNumSecondaryRays()
+             << " reflected and refracted rays.\n";
+    scene.reportShadows(cout);
+    double seconds = chrono::duration<double>(tracing).count();
+    uint64_t allRays = rays + haloRays + scene.getNumSecondaryRays() + scene.getNumShadowRays();
+    cout << "Traced " << allRays << " rays in " << seconds << " s ("
+         << allRays / seconds / 1e6 << " Mrays/s).\n";
+    if (outputs.guides)
+        cout << "Denoised in " << chrono::duration<double, milli>(denoising).count()
+             << " ms.\n";
+    if (haloRays != 0)
+        cout << "Traced " << haloRays << " primary rays again for the rows"
+                " around the bands.\n";
+
+    if (adaptive)
+    {
+        long long fixed = (long long)settings.width * settings.height * settings.samples;
+        long long saved = fixed - (long long)rays;
+        cout << "Adaptive sampling traced " << rays << " primary rays, "
+             << saved << " (" << 100.0 * saved / fixed << "%) fewer than "
+             << settings.samples << " per pixel.\n";
+
+        // averages of the tiles, the last row and column may be partial
+        for (size_t tile = 0; tile != tileSamples.size(); ++tile)
+        {
+            unsigned x0 = tile % tilesX * settings.tileSize;
+            unsigned y0 = tile / tilesX * settings.tileSize;
+            tileSamples[tile] /= double(min(settings.tileSize, settings.width - x0))
+                * min(settings.tileSize, settings.height - y0);
+        }
+        writeSampleMap(tileSamples, settings.tileSize);
+    }
+    return true;
+}
+
+void Raytracer::writeSampleMap(vector<double> const &cells, unsigned cellSize) const
+{
+    if (settings.sampleMap.empty())
+        return;
+
+    unsigned cellsX = (settings.width + cellSize - 1) / cellSize;
+    ofstream map(settings.sampleMap);
+    map << "# samples per pixel of each " << cellSize << 'x' << cellSize
+        << " tile\n";
+    for (size_t cell = 0; cell != cells.size(); ++cell)
+        map << cells[cell] << ((cell + 1) % cellsX == 0 ? '\n' : ' ');
+}
+
+bool Raytracer::renderProgressive(ImageWriter &writer,
+                                  chrono::steady_clock::time_point start)
+{
+    // A budget runs from the start of the frame, bands are not used
+    auto deadline = chrono::steady_clock::time_point::max();
+    if (settings.timeBudget > 0)
+        deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(
+            chrono::duration<double>(settings.timeBudget));
+    Image img(settings.width, settings.height, settings.framebuffer);
+    vector<double> tileSamples;
+
+    // Previews after every pass but the last: full size frames of a stream
+    // output, or a quickly compressed PNG at the resolution of the pass
+    // that replaces the preview file at once
+    PNGWriter previewWriter(1, settings.threads, settings.srgb, settings.dither);
+    auto preview = [&](unsigned pass, unsigned numPasses, unsigned spacing)
+    {
+        cout << "Pass " << pass + 1 << " of " << numPasses << " done.\n";
+        if (!settings.progressive || pass + 1 == numPasses)
+            return;
+
+        if (writer.isStream())
+        {
+            // blocks of the coarse passes are filled in here
+            Image frame(img.width(), img.height(), img.format());
+            for (unsigned y = 0; y != frame.height(); ++y)
+                for (unsigned x = 0; x != frame.width(); ++x)
+                    frame(x, y) = img(x / spacing * spacing, y / spacing * spacing);
+            if (settings.toneMapping)
+                frame.toneMap(settings.toneMap, settings.exposure);
+            writer.write(frame, 0);
+        }
+        else if (!settings.previewFile.empty())
+        {
+            Image frame((img.width() + spacing - 1) / spacing,
+                        (img.height() + spacing - 1) / spacing);
+            for (unsigned y = 0; y != frame.height(); ++y)
+                for (unsigned x = 0; x != frame.width(); ++x)
+                    frame(x, y) = img(x * spacing, y * spacing);
+            if (settings.toneMapping)
+                frame.toneMap(settings.toneMap, settings.exposure);
+
+            string tmp = settings.previewFile + ".tmp";
+            previewWriter.open(tmp, frame.width(), frame.height());
+            previewWriter.write(frame, 0);
+            if (previewWriter.close())
+                rename(tmp.c_str(), settings.previewFile.c_str());
+        }
+    };
+
+    cout << "Tracing progressively";
+    if (settings.timeBudget > 0)
+        cout << " within " << settings.timeBudget << " s";
+    cout << "...\n";
+    bool finished = scene.renderProgressive(img, deadline, tileSamples, preview);
+    auto traced = chrono::steady_clock::now();
+
+    double least = *min_element(tileSamples.begin(), tileSamples.end());
+    double most = *max_element(tileSamples.begin(), tileSamples.end());
+    cout << (finished ? "Finished" : "Stopped") << " after "
+         << chrono::duration<double>(traced - start).count() << " s, "
+         << least << " to " << most << " samples per pixel.\n";
+
+    writeSampleMap(tileSamples, scene.progressiveTileSize());
+
+    // The budget covers tracing (and the previews between passes), the
+    // final image comes on top of it
+    if (settings.toneMapping)
+        img.toneMap(settings.toneMap, settings.exposure);
+    writer.write(img, 0);
+    cout << "Written in " << chrono::duration<double>(chrono::steady_clock::now() - traced).count()
+         << " s after tracing.\n";
+    return true;
+}
+
+ImageWriter *Raytracer::createWriter(string const &ofname) const
+{
+    // "OutputFormat", else by extension; a bare "-" streams y4m to
+    // standard output
+    string extension = settings.outputFormat;
+    if (extension.empty())
+        extension = ofname == "-" ? "y4m" : ofname.substr(ofname.find_last_of('.') + 1);
+    transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    unique_ptr<ImageWriter> writer;
+    if (extension == "pfm")
+        writer.reset(new PFMWriter);
+    else if (extension == "exr")
+        writer.reset(new EXRWriter(settings.framebuffer == Image::RGB16F));
+    else if (extension == "rgb" || extension == "raw")
+        writer.reset(new RawWriter(settings.srgb, settings.dither));
+    else if (extension == "y4m")
+        writer.reset(new Y4MWriter(settings.frameRate, settings.srgb, settings.dither));
+    else
+        writer.reset(new PNGWriter(settings.pngLevel, settings.threads, settings.srgb, settings.dither));
+
+    if (!writer->open(ofname, settings.width, settings.height))
+        return nullptr;
+    return writer.release();
+}
+
+string Raytracer::outputExtension() const
+{
+    return settings.outputFormat.empty() ? "png" : settings.outputFormat;
+}
+
+void Raytracer::overrideSetting(string const &option, string const &value)
 {
-    // TODO: the size may be a settings in your file
-    Image img(400, 400);
-    cout << "Tracing...\n";
-    scene.render(img);
-    cout << "Writing image to " << ofname << "...\n";
-    img.write_png(ofname);
-    cout << "Done.\n";
+    overrides.push_back(make_pair(option, value));
 }
@@ -1,8 +1,14 @@
 #ifndef RAYTRACER_H_
 #define RAYTRACER_H_
 
+#include "image.h"
 #include "scene.h"
+#include "settings.h"
+#include <chrono>
+#include <cstdint>
 #include <string>
+#include <utility>
+#include <vector>
 
 // Symbolic Constants.
 #define OBJ_UNDEFINED   -1
@@ -13,6 +19,7 @@
 #define OBJ_MESH        4
 
 // Forward declerations
+class ImageWriter;
 class Light;
 class Material;
 
@@ -21,15 +28,40 @@ class Material;
 class Raytracer
 {
     Scene scene;
+    Settings settings;
+    std::vector<std::pair<std::string, std::string>> overrides;
 
     public:
 
         // Provided Public Methods.
         bool readScene(std::string const &ifname);
-        void renderToFile(std::string const &ofname);
+
+        // Command line setting, applied over the scene's "Settings" by
+        // readScene (see settings.h)
+        void overrideSetting(std::string const &option, std::string const &value);
+
+        // Writer for the output format ("OutputFormat" or the extension),
+        // opened for an image of the scene's size; nullptr on failure
+        ImageWriter *createWriter(std::string const &ofname) const;
+
+        // Trace one frame into an open writer of the same size. The "AOVs"
+        // are written to files named after filename (see aovs.h).
+        bool render(ImageWriter &writer, std::string const &filename = "");
+
+        // Extension of the configured output format, "png" by default
+        std::string outputExtension() const;
 
     private:
 
+        // Render in passes of increasing quality ("Progressive"), stopping
+        // at the "TimeBudget" from start if there is one
+        bool renderProgressive(ImageWriter &writer,
+                               std::chrono::steady_clock::time_point start);
+
+        // Write the samples per pixel of every cellSize square cell to
+        // the "SampleMap" file, one row of cells per line
+        void writeSampleMap(std::vector<double> const &cells, unsigned cellSize) const;
+
         // Helper Private Method for mapping object-type to integer.
         int objectType (std::string const &ofname);
 
@@ -41,7 +73,10 @@ class Raytracer
         void loadMesh (nlohmann::json const &node, std::vector<ObjectPtr> &sceneObjects);
 
         // Provided Private Methods.
-        bool parseObjectNode(nlohmann::json const &node);
+        bool parseObjectNode(nlohmann::json const &node, unsigned id);
+
+        // Hash of everything the acceleration structure depends on
+        uint64_t geometryKey(nlohmann::json const &objects) const;
 
         Light parseLightNode(nlohmann::json const &node) const;
         Material parseMaterialNode(nlohmann::json const &node) const;
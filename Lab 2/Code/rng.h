@@ -0,0 +1,71 @@
+#ifndef RNG_H_
+#define RNG_H_
+
+#include <cstdint>
+
+// Counter-based random numbers: Philox4x32-10 (Salmon et al., "Parallel
+// random numbers: as easy as 1, 2, 3"). The output is a bijective function
+// of a 128 bit counter under a 64 bit key, so there is no state to share
+// or advance: keyed by (pixel, sample, dimension), every value is the same
+// whichever thread, tile or order computes it.
+class Philox
+{
+    uint32_t d_key[2];
+
+    public:
+        explicit Philox(uint64_t seed)
+        :
+            d_key{uint32_t(seed), uint32_t(seed >> 32)}
+        {}
+
+        uint64_t seed() const
+        {
+            return d_key[0] | uint64_t(d_key[1]) << 32;
+        }
+
+        // Four random words for the counter (a, b, c, d)
+        void generate(uint32_t a, uint32_t b, uint32_t c, uint32_t d,
+                      uint32_t out[4]) const
+        {
+            uint32_t ctr[4] = {a, b, c, d};
+            uint32_t k0 = d_key[0];
+            uint32_t k1 = d_key[1];
+            for (unsigned round = 0; round != 10; ++round)
+            {
+                uint64_t p0 = uint64_t(0xd2511f53u) * ctr[0];
+                uint64_t p1 = uint64_t(0xcd9e8d57u) * ctr[2];
+                uint32_t next[4] =
+                {
+                    uint32_t(p1 >> 32) ^ ctr[1] ^ k0,
+                    uint32_t(p1),
+                    uint32_t(p0 >> 32) ^ ctr[3] ^ k1,
+                    uint32_t(p0)
+                };
+                for (unsigned i = 0; i != 4; ++i)
+                    ctr[i] = next[i];
+                k0 += 0x9e3779b9u;      // Weyl sequence key schedule
+                k1 += 0xbb67ae85u;
+            }
+            for (unsigned i = 0; i != 4; ++i)
+                out[i] = ctr[i];
+        }
+
+        // One random word for sample `sample` of pixel (x, y) in the given
+        // dimension
+        uint32_t bits(unsigned x, unsigned y, unsigned sample,
+                      unsigned dimension) const
+        {
+            uint32_t out[4];
+            generate(x, y, sample, dimension, out);
+            return out[0];
+        }
+
+        // Same, uniform in [0, 1)
+        double uniform(unsigned x, unsigned y, unsigned sample,
+                       unsigned dimension) const
+        {
+            return bits(x, y, sample, dimension) * (1.0 / 4294967296.0);
+        }
+};
+
+#endif
@@ -0,0 +1,381 @@
+#include "sampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// Edge of the tiled blue noise mask
+#define MASK_SIZE   64
+
+// Philox counters with these as the sample index give the per pixel (not
+// per sample) random values: scrambling seeds and index shuffles
+#define PIXEL_SCRAMBLE  0xffffffffu
+#define PIXEL_SHUFFLE   0xfffffffeu
+
+// Dimensions of the blue noise sampler with precomputed mask offsets
+#define BLUE_NOISE_DIMS 16
+
+// --- Hashing and scrambling --------------------------------------------------
+
+static uint32_t reverseBits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Owen scrambling of a 32 bit fraction: every bit is flipped depending on
+// the bits above it. The Laine-Karras hash does this for the low bits,
+// so it is applied to the reversed value.
+static uint32_t owenScramble(uint32_t x, uint32_t seed)
+{
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+static double toUnit(uint32_t x)
+{
+    return x * (1.0 / 4294967296.0);
+}
+
+static double fraction(double x)
+{
+    return x - floor(x);
+}
+
+// --- Sobol points ------------------------------------------------------------
+
+// Direction numbers of the first 4 dimensions (Joe and Kuo): dimension 0
+// is the van der Corput sequence, the others follow from a primitive
+// polynomial of degree s with inner coefficients a and initial m values.
+static uint32_t const *sobolDirections(unsigned dimension)
+{
+    static vector<uint32_t> const table = []
+    {
+        struct { unsigned s; unsigned a; unsigned m[3]; } const params[3] =
+        {
+            {1, 0, {1}},
+            {2, 1, {1, 3}},
+            {3, 1, {1, 3, 1}}
+        };
+        vector<uint32_t> directions(4 * 32);
+        for (unsigned bit = 0; bit != 32; ++bit)
+            directions[bit] = 1u << (31 - bit);
+        for (unsigned dim = 1; dim != 4; ++dim)
+        {
+            unsigned s = params[dim - 1].s;
+            unsigned a = params[dim - 1].a;
+            uint32_t *v = &directions[dim * 32];
+            for (unsigned bit = 0; bit != 32; ++bit)
+            {
+                if (bit < s)
+                {
+                    v[bit] = params[dim - 1].m[bit] << (31 - bit);
+                    continue;
+                }
+                v[bit] = v[bit - s] ^ (v[bit - s] >> s);
+                for (unsigned k = 1; k < s; ++k)
+                    if ((a >> (s - 1 - k)) & 1)
+                        v[bit] ^= v[bit - k];
+            }
+        }
+        return directions;
+    }();
+    return &table[dimension * 32];
+}
+
+static uint32_t sobol(uint32_t index, unsigned dimension)
+{
+    // The xor of the directions of the set bits of the index, by byte
+    static vector<uint32_t> const table = []
+    {
+        vector<uint32_t> bytes(4 * 4 * 256, 0);
+        for (unsigned dim = 0; dim != 4; ++dim)
+        {
+            uint32_t const *v = sobolDirections(dim);
+            for (unsigned byte = 0; byte != 4; ++byte)
+                for (unsigned value = 0; value != 256; ++value)
+                    for (unsigned bit = 0; bit != 8; ++bit)
+                        if (value >> bit & 1)
+                            bytes[(dim * 4 + byte) * 256 + value] ^= v[8 * byte + bit];
+        }
+        return bytes;
+    }();
+
+    uint32_t const *t = &table[dimension * 4 * 256];
+    return t[index & 0xff] ^ t[256 + (index >> 8 & 0xff)]
+        ^ t[512 + (index >> 16 & 0xff)] ^ t[768 + (index >> 24)];
+}
+
+// --- Sampler -----------------------------------------------------------------
+
+Sampler::Sampler(uint64_t seed)
+:
+    d_rng(seed)
+{}
+
+bool Sampler::isSequence() const
+{
+    return false;
+}
+
+Sampler *Sampler::create(string const &name, unsigned samples, uint64_t seed)
+{
+    if (name == "stratified")
+        return new StratifiedSampler(samples, seed);
+    if (name == "r2")
+        return new R2Sampler(seed);
+    if (name == "sobol" || name == "owen")
+        return new SobolSampler(name == "owen", seed);
+    if (name == "bluenoise")
+        return new BlueNoiseSampler(seed);
+    return nullptr;
+}
+
+// --- StratifiedSampler -------------------------------------------------------
+
+StratifiedSampler::StratifiedSampler(unsigned samples, uint64_t seed)
+:
+    Sampler(seed),
+    d_samples(max(1u, samples))
+{}
+
+double StratifiedSampler::sample(unsigned x, unsigned y, unsigned index,
+                                 unsigned dimension) const
+{
+    if (dimension == 0)
+        return (index + 0.5) / d_samples;
+    if (dimension == 1)
+        return fraction(0.5 + index * 0.6180339887498949);
+
+    // strata of one dimension, shifted randomly per pixel
+    return fraction((index + 0.5) / d_samples + d_rng.uniform(x, y, PIXEL_SCRAMBLE, dimension));
+}
+
+// --- R2Sampler ---------------------------------------------------------------
+
+R2Sampler::R2Sampler(uint64_t seed)
+:
+    Sampler(seed)
+{}
+
+double R2Sampler::sample(unsigned x, unsigned y, unsigned index,
+                         unsigned dimension) const
+{
+    double alpha = dimension % 2 == 0 ? 0.7548776662466927 : 0.5698402909980532;
+    double shift = dimension < 2 ? 0.5 : d_rng.uniform(x, y, PIXEL_SCRAMBLE, dimension);
+    return fraction(shift + index * alpha);
+}
+
+bool R2Sampler::isSequence() const
+{
+    return true;
+}
+
+// --- SobolSampler ------------------------------------------------------------
+
+SobolSampler::SobolSampler(bool owen, uint64_t seed)
+:
+    Sampler(seed),
+    d_owen(owen)
+{}
+
+double SobolSampler::sample(unsigned x, unsigned y, unsigned index,
+                            unsigned dimension) const
+{
+    uint32_t const *seeds = groupSeeds(x, y, dimension / 4);
+
+    // 1. Shuffle the index per pixel and group of 4 dimensions, so that
+    //    the groups are independent.
+    uint32_t shuffled = owenScramble(index, seeds[0]);
+
+    // 2. Scramble the point per dimension.
+    uint32_t value = sobol(shuffled, dimension % 4);
+    uint32_t scramble = seeds[1 + dimension % 4];
+    return toUnit(d_owen ? owenScramble(value, scramble) : value ^ scramble);
+}
+
+uint32_t const *SobolSampler::groupSeeds(unsigned x, unsigned y,
+                                         unsigned group) const
+{
+    // A pixel asks for all its samples in a row, so the last group is
+    // kept per thread instead of running Philox for every value
+    struct Cache
+    {
+        uint64_t seed;
+        unsigned x = ~0u;
+        unsigned y = ~0u;
+        unsigned group = ~0u;
+        uint32_t words[8];
+    };
+    static thread_local Cache cache;
+
+    if (cache.x != x || cache.y != y || cache.group != group
+        || cache.seed != d_rng.seed())
+    {
+        cache.seed = d_rng.seed();
+        cache.x = x;
+        cache.y = y;
+        cache.group = group;
+        d_rng.generate(x, y, PIXEL_SCRAMBLE, 2 * group, cache.words);
+        d_rng.generate(x, y, PIXEL_SCRAMBLE, 2 * group + 1, cache.words + 4);
+    }
+    return cache.words;
+}
+
+bool SobolSampler::isSequence() const
+{
+    return true;
+}
+
+// --- BlueNoiseSampler --------------------------------------------------------
+
+BlueNoiseSampler::BlueNoiseSampler(uint64_t seed)
+:
+    Sampler(seed),
+    d_mask(mask())
+{
+    for (unsigned dimension = 0; dimension != BLUE_NOISE_DIMS; ++dimension)
+        d_offsets.push_back(d_rng.bits(0, 0, PIXEL_SCRAMBLE, dimension));
+}
+
+double BlueNoiseSampler::sample(unsigned x, unsigned y, unsigned index,
+                                unsigned dimension) const
+{
+    // Every dimension reads the mask at its own random offset, the groups
+    // of 4 dimensions get their own (but shared by all pixels) index shuffle
+    uint32_t offset = dimension < BLUE_NOISE_DIMS ? d_offsets[dimension]
+        : d_rng.bits(0, 0, PIXEL_SCRAMBLE, dimension);
+    unsigned mx = (x + offset) % MASK_SIZE;
+    unsigned my = (y + (offset >> 16)) % MASK_SIZE;
+    double shift = (d_mask[my * MASK_SIZE + mx] + 0.5) / (MASK_SIZE * MASK_SIZE);
+
+    uint32_t shuffled = dimension < 4 ? index
+        : owenScramble(index, d_rng.bits(0, 0, PIXEL_SHUFFLE, dimension / 4));
+    return fraction(toUnit(sobol(shuffled, dimension % 4)) + shift);
+}
+
+bool BlueNoiseSampler::isSequence() const
+{
+    return true;
+}
+
+vector<uint16_t> const &BlueNoiseSampler::mask()
+{
+    // Void and cluster (Ulichney): the energy of a pixel is the Gaussian
+    // weighted count of the marked pixels around it, on the torus.
+    // Repeatedly marking the largest void (lowest energy) or unmarking the
+    // tightest cluster (highest energy) ranks the pixels so that every
+    // threshold of the ranks gives an evenly spread pattern.
+    static vector<uint16_t> const ranks = []
+    {
+        unsigned const n = MASK_SIZE * MASK_SIZE;
+        double const sigma = 1.5;
+
+        vector<double> kernel(n);
+        for (unsigned dy = 0; dy != MASK_SIZE; ++dy)
+        {
+            for (unsigned dx = 0; dx != MASK_SIZE; ++dx)
+            {
+                double ex = min(dx, MASK_SIZE - dx);
+                double ey = min(dy, MASK_SIZE - dy);
+                kernel[dy * MASK_SIZE + dx] = exp(-(ex * ex + ey * ey) / (2 * sigma * sigma));
+            }
+        }
+
+        vector<char> marked(n, 0);
+        vector<double> energy(n, 0.0);
+        auto toggle = [&](unsigned p, vector<char> &pattern, vector<double> &field)
+        {
+            pattern[p] ^= 1;
+            double sign = pattern[p] ? 1.0 : -1.0;
+            unsigned px = p % MASK_SIZE;
+            unsigned py = p / MASK_SIZE;
+            for (unsigned qy = 0; qy != MASK_SIZE; ++qy)
+            {
+                double const *row = &kernel[(qy + MASK_SIZE - py) % MASK_SIZE * MASK_SIZE];
+                double *out = &field[qy * MASK_SIZE];
+                for (unsigned qx = 0; qx != MASK_SIZE; ++qx)
+                    out[qx] += sign * row[qx >= px ? qx - px : qx + MASK_SIZE - px];
+            }
+        };
+        // extreme energy among the pixels with pattern == value
+        auto extreme = [&](vector<char> const &pattern, vector<double> const &field,
+                           char value, bool highest)
+        {
+            unsigned best = n;
+            for (unsigned p = 0; p != n; ++p)
+                if (pattern[p] == value && (best == n
+                    || (highest ? field[p] > field[best] : field[p] < field[best])))
+                    best = p;
+            return best;
+        };
+
+        // 1. A random tenth of the pixels, spread out by moving the
+        //    tightest cluster to the largest void until that is a no-op.
+        Philox rng(0);
+        unsigned ones = n / 10;
+        for (unsigned draw = 0, count = 0; count != ones; ++draw)
+        {
+            unsigned p = rng.bits(draw, 0, 0, 0) % n;
+            if (!marked[p])
+            {
+                toggle(p, marked, energy);
+                ++count;
+            }
+        }
+        for (unsigned moves = 0; moves != n; ++moves)
+        {
+            unsigned cluster = extreme(marked, energy, 1, true);
+            toggle(cluster, marked, energy);
+            unsigned gap = extreme(marked, energy, 0, false);
+            toggle(gap, marked, energy);
+            if (gap == cluster)
+                break;
+        }
+
+        // 2. Ranks below the initial pattern: remove tightest clusters.
+        vector<uint16_t> rank(n);
+        vector<char> pattern(marked);
+        vector<double> field(energy);
+        for (unsigned r = ones; r-- != 0; )
+        {
+            unsigned cluster = extreme(pattern, field, 1, true);
+            toggle(cluster, pattern, field);
+            rank[cluster] = r;
+        }
+
+        // 3. Up to half: fill the largest voids.
+        for (unsigned r = ones; r != n / 2; ++r)
+        {
+            unsigned gap = extreme(marked, energy, 0, false);
+            toggle(gap, marked, energy);
+            rank[gap] = r;
+        }
+
+        // 4. The rest: the unmarked pixels are now the minority, so fill
+        //    their tightest clusters, by the energy of the unmarked ones.
+        vector<char> unmarked(n);
+        vector<double> voids(n, 0.0);
+        for (unsigned p = 0; p != n; ++p)
+            if (!marked[p])
+                toggle(p, unmarked, voids);
+        for (unsigned r = n / 2; r != n; ++r)
+        {
+            unsigned cluster = extreme(unmarked, voids, 1, true);
+            toggle(cluster, unmarked, voids);
+            rank[cluster] = r;
+        }
+        return rank;
+    }();
+    return ranks;
+}
@@ -0,0 +1,103 @@
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include "rng.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Sample values in [0, 1) for sample `index` of pixel (x, y), one value
+// per dimension: 0 and 1 place the sample in the pixel, later dimensions
+// are for other effects. Values depend only on these arguments and the
+// seed (all randomness comes from a counter-based Philox generator), so
+// renders are the same for any number of threads and any tile order.
+class Sampler
+{
+    protected:
+        Philox d_rng;
+
+    public:
+        explicit Sampler(uint64_t seed);
+        virtual ~Sampler() = default;
+
+        virtual double sample(unsigned x, unsigned y, unsigned index,
+                              unsigned dimension) const = 0;
+
+        // whether every prefix of the samples is well distributed, so a
+        // pixel can stop at any count (adaptive sampling)
+        virtual bool isSequence() const;
+
+        // "stratified", "r2", "sobol", "owen" or "bluenoise" for a fixed
+        // count of samples per pixel; nullptr for an unknown name
+        static Sampler *create(std::string const &name, unsigned samples,
+                               uint64_t seed = 0);
+};
+
+// The default: x stratified over the samples, y on the golden ratio
+// lattice, so a single sample is the pixel center
+class StratifiedSampler: public Sampler
+{
+    unsigned d_samples;
+
+    public:
+        StratifiedSampler(unsigned samples, uint64_t seed = 0);
+
+        virtual double sample(unsigned x, unsigned y, unsigned index,
+                              unsigned dimension) const;
+};
+
+// The R2 sequence (generalized golden ratio) in dimensions 0 and 1,
+// rotated per pixel beyond. Sample 0 is the pixel center.
+class R2Sampler: public Sampler
+{
+    public:
+        explicit R2Sampler(uint64_t seed = 0);
+
+        virtual double sample(unsigned x, unsigned y, unsigned index,
+                              unsigned dimension) const;
+        virtual bool isSequence() const;
+};
+
+// Sobol points in 4 dimensions, padded to more by shuffling the index per
+// group of 4 dimensions and pixel. Scrambling decorrelates the pixels:
+// random digit (xor) scrambling, or Owen's nested uniform scrambling,
+// which also keeps the points stratified but randomizes their structure.
+class SobolSampler: public Sampler
+{
+    bool d_owen;
+
+    public:
+        SobolSampler(bool owen, uint64_t seed = 0);
+
+        virtual double sample(unsigned x, unsigned y, unsigned index,
+                              unsigned dimension) const;
+        virtual bool isSequence() const;
+
+    private:
+        // random words of pixel (x, y) for a group of 4 dimensions: the
+        // index shuffle, then the scramble of every dimension
+        uint32_t const *groupSeeds(unsigned x, unsigned y, unsigned group) const;
+};
+
+// One unscrambled Sobol sequence for all pixels, shifted per pixel and
+// dimension by a tiled blue noise mask. At low sample counts the error is
+// then blue noise over the image instead of white, which looks smoother.
+class BlueNoiseSampler: public Sampler
+{
+    std::vector<uint16_t> const &d_mask;    // ranks, MASK_SIZE squared
+    std::vector<uint32_t> d_offsets;        // mask offsets of dimensions
+
+    public:
+        explicit BlueNoiseSampler(uint64_t seed = 0);
+
+        virtual double sample(unsigned x, unsigned y, unsigned index,
+                              unsigned dimension) const;
+        virtual bool isSequence() const;
+
+    private:
+        // void-and-cluster ranks, built on first use
+        static std::vector<uint16_t> const &mask();
+};
+
+#endif
@@ -1,88 +1,1363 @@
 #include "scene.h"
 
+#include "aabb.h"
+#include "aovs.h"
+#include "denoiser.h"
 #include "hit.h"
 #include "image.h"
 #include "material.h"
+#include "morton.h"
+#include "parallel.h"
 #include "ray.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <limits>
+#include <ostream>
+#include <stdexcept>
 
 using namespace std;
 
+// Rows per batch when rendering with streamed meshes
+#define STREAM_BATCH_ROWS   16
+
+// Pixel spacing of the first progressive pass: 1/16 of the resolution,
+// then 1/4, then full
+#define COARSEST_BLOCK      4
+
+// Most samples per pixel a full resolution progressive pass adds
+#define MAX_PASS_SAMPLES    16
+
+// Adaptive sampling: samples every pixel gets first (at most the average),
+// and the most a pixel gets, as a multiple of the average
+#define MIN_ADAPTIVE_SAMPLES    4
+#define MAX_ADAPTIVE_FACTOR     4
+
+// Edge anti-aliasing: neighbours whose normals are further apart than
+// about 25 degrees, or whose depths differ by more than a tenth, lie
+// across an edge
+#define EDGE_NORMAL_COS     0.9
+#define EDGE_DEPTH_RATIO    0.1
+
+// Reflection and refraction: the deepest bounce any setting allows, the
+// weight below which Russian roulette may end a branch, and how far the
+// origins of secondary rays move off the surface (against hitting it
+// again), relative to the distance of the hit
+#define MAX_TRACE_DEPTH     32
+#define ROULETTE_WEIGHT     0.1
+#define SECONDARY_OFFSET    1e-6
+
+// Light selection: the most lights a hit may evaluate, and the Philox
+// dimensions of its random numbers (one per path vertex)
+#define MAX_LIGHT_SAMPLES   1024
+#define LIGHT_DIMENSION     0x80000000u
+
+// Wavefront rendering: the paths (samples) traced together, the rays per
+// job of a stage, and the Philox dimensions of the roulette (one per
+// decision of a path)
+#define WAVEFRONT_PATHS     (1 << 15)
+#define WAVEFRONT_CHUNK     256
+#define ROULETTE_DIMENSION  0x40000000u
+
+// Ray sorting: bits per axis of the quantized directions, and of the
+// origin cells, in the Morton key of a secondary or shadow ray
+#define SORT_DIRECTION_BITS 3
+#define SORT_ORIGIN_BITS    10
+
+// Shadow rays: per thread, the object that last hid each light, valid for
+// the build of shadowEpoch, and the counts not yet added to the scene's
+struct OccluderCache
+{
+    uint64_t epoch = 0;
+    vector<Object *> blockers;
+    uint64_t rays = 0;
+    uint64_t blocked = 0;
+    uint64_t tests = 0;
+    uint64_t hits = 0;
+};
+static thread_local OccluderCache occluderCache;
+static atomic<uint64_t> occluderEpochs{0};
+
+// The cells of a w x h grid, as y * w + x, in the given order. The curves
+// run through the enclosing power of two square, cells outside the grid
+// are left out.
+static vector<uint32_t> cellOrder(unsigned w, unsigned h, PixelOrder order)
+{
+    vector<uint32_t> cells(size_t(w) * h);
+    for (uint32_t idx = 0; idx != cells.size(); ++idx)
+        cells[idx] = idx;
+    if (order == SCANLINE_ORDER)
+        return cells;
+
+    unsigned bits = 0;
+    while ((1u << bits) < max(w, h))
+        ++bits;
+    vector<pair<uint32_t, uint32_t>> keyed(cells.size());
+    for (uint32_t idx = 0; idx != cells.size(); ++idx)
+    {
+        uint32_t x = idx % w;
+        uint32_t y = idx / w;
+        keyed[idx].first = order == MORTON_ORDER ? morton2(x, y) : hilbert2(bits, x, y);
+        keyed[idx].second = idx;
+    }
+    sort(keyed.begin(), keyed.end());
+    for (uint32_t idx = 0; idx != cells.size(); ++idx)
+        cells[idx] = keyed[idx].second;
+    return cells;
+}
+
 Color Scene::trace(Ray const &ray)
+{
+    Surface surface;
+    return trace(ray, surface, 0, 0, 0);
+}
+
+Color Scene::trace(Ray const &ray, Surface &surface, unsigned x, unsigned y,
+                   unsigned s)
 {
     // Find hit object and distance
     Hit min_hit(numeric_limits<double>::infinity(), Vector());
-    ObjectPtr obj = nullptr;
+    Object *obj = intersect(ray, min_hit);
+    surface.obj = obj;
+    surface.N = min_hit.N;
+    surface.t = min_hit.t;
+    surface.lobes = Lobes();
 
-    // Parallelization with OpenMP.
-    //#pragma omp parallel for
-    for (unsigned idx = 0; idx != objects.size(); ++idx)
+    // No hit? Return background color.
+    if (!obj) return Color(0.0, 0.0, 0.0);
+
+    PathVertex vertex{x, y, s, 0};
+    Color color = shade(ray, min_hit, *obj, &surface.lobes, vertex);
+    Material const &material = materials[obj->material];
+    if (material.reflect > 0 || material.refract > 0)
+    {
+        surface.lobes.reflection = secondary(ray, min_hit, *obj, x, y, s);
+        color += surface.lobes.reflection;
+    }
+    return color;
+}
+
+// The ray tree of reflection and refraction, without recursion: branches
+// wait on an explicit stack with the weight their light gets. A branch
+// ends at the max depth, when the sample's share of the pixel's ray budget
+// is used up, or by Russian roulette: a branch lighter than ROULETTE_WEIGHT
+// survives with probability weight / ROULETTE_WEIGHT and then weighs
+// ROULETTE_WEIGHT, which keeps the mean the same while weak branches
+// mostly stop and strong ones add no noise. The heavier branch of a hit
+// is traced first.
+Color Scene::secondary(Ray const &ray, Hit const &hit, Object const &obj,
+                       unsigned x, unsigned y, unsigned s)
+{
+    struct Branch
+    {
+        Ray ray{Point(), Vector()};
+        double weight = 0.0;
+        unsigned depth = 0;
+    };
+    Branch stack[MAX_TRACE_DEPTH + 1];      // a branch per depth, plus one
+    unsigned top = 0;
+    unsigned decisions = 0;                 // roulette dimensions used
+
+    // push the reflected and refracted branches of a hit, after roulette,
+    // the lighter one first
+    auto branch = [&](Ray const &in, Hit const &at, Material const &material,
+                      double weight, unsigned depth)
+    {
+        if (depth >= maxDepth)
+            return;
+
+        Scattered out = scatter(in, at, material);
+        auto push = [&](Ray const &next, double w)
+        {
+            w *= weight;
+            if (w <= 0)
+                return;
+            if (w < ROULETTE_WEIGHT)
+            {
+                if (sampler->sample(x, y, s, 2 + decisions++) * ROULETTE_WEIGHT >= w)
+                    return;
+                w = ROULETTE_WEIGHT;
+            }
+            stack[top].ray = next;
+            stack[top].weight = w;
+            stack[top++].depth = depth + 1;
+        };
+        if (out.kr < out.kt)
+        {
+            push(out.reflected, out.kr);
+            push(out.refracted, out.kt);
+        }
+        else
+        {
+            push(out.refracted, out.kt);
+            push(out.reflected, out.kr);
+        }
+    };
+
+    unsigned budget = rayBudget == 0 ? numeric_limits<unsigned>::max()
+        : max(rayBudget / samples, 1u) - 1;
+    unsigned rays = 0;
+    Color light;
+    branch(ray, hit, materials[obj.material], 1.0, 0);
+    while (top != 0 && rays != budget)
+    {
+        Branch const next = stack[--top];
+        ++rays;
+        Hit nextHit(numeric_limits<double>::infinity(), Vector());
+        Object *nextObj = intersect(next.ray, nextHit);
+        if (!nextObj)
+            continue;
+        PathVertex vertex{x, y, s, rays};
+        light += next.weight * shade(next.ray, nextHit, *nextObj, nullptr, vertex);
+        branch(next.ray, nextHit, materials[nextObj->material], next.weight, next.depth);
+    }
+    secondaryRays.fetch_add(rays, memory_order_relaxed);
+    return light;
+}
+
+// Faces the normal against the ray, then refracts by Snell's law with
+// Schlick's Fresnel term; total internal reflection reflects all.
+Scattered Scene::scatter(Ray const &in, Hit const &at, Material const &material) const
+{
+    Point P = in.at(at.t);
+    Vector N = at.N;
+    double cosIn = -N.dot(in.D);
+    bool entering = cosIn >= 0;
+    if (!entering)
     {
-        Hit hit(objects[idx]->intersect(ray));
+        N = -N;
+        cosIn = -cosIn;
+    }
+
+    Scattered out;
+    out.kr = material.reflect;
+    if (material.refract > 0)
+    {
+        double ratio = entering ? 1.0 / material.eta : material.eta;
+        double k = 1.0 - ratio * ratio * (1.0 - cosIn * cosIn);
+        if (k < 0)
+            out.kr += material.refract;
+        else
+        {
+            double cosOut = sqrt(k);
+            Vector T = ratio * in.D + (ratio * cosIn - cosOut) * N;
+            double r0 = (1.0 - material.eta) / (1.0 + material.eta);
+            r0 *= r0;
+            double fresnel = r0 + (1.0 - r0) * pow(1.0 - (entering ? cosIn : cosOut), 5);
+            out.kr += material.refract * fresnel;
+            out.kt = material.refract * (1.0 - fresnel);
+            out.refracted = Ray(P - SECONDARY_OFFSET * at.t * N, T);
+        }
+    }
+    out.reflected = Ray(P + SECONDARY_OFFSET * at.t * N, in.D + 2.0 * cosIn * N);
+    return out;
+}
+
+void Scene::record(BandOutputs const &outputs, unsigned x, unsigned y,
+                   Color const &color, Surface const &surface) const
+{
+    if (outputs.guides)
+    {
+        outputs.guides->addSample(x, y, color);
+        if (surface.obj)
+            outputs.guides->addHit(x, y, surface.N, surface.t,
+                                   materials[surface.obj->material].color);
+    }
+    if (outputs.aovs)
+        outputs.aovs->add(x, y, surface);
+}
+
+Object *Scene::intersect(Ray const &ray, Hit &min_hit)
+{
+    int idx = bvh.intersect(ray, min_hit);
+    Object *obj = idx < 0 ? nullptr : objects[idx];
+
+    for (StreamedMeshPtr const &mesh : meshes)
+    {
+        Hit hit(mesh->intersect(ray));
         if (hit.t < min_hit.t)
         {
             min_hit = hit;
-            obj = objects[idx];
+            obj = mesh;
         }
     }
+    return obj;
+}
 
-    // No hit? Return background color.
-    if (!obj) return Color(0.0, 0.0, 0.0);
-
-    Material material = obj->material;          //the hit objects material
+// With more lights than lightSamples, the lights are picked from an alias
+// table by power (the luminance of their color), lightSamples of them
+// stratified over the table, each weighted by 1 / (lightSamples * its
+// probability). The sum over all lights is then estimated without bias at
+// a cost that does not grow with the number of lights; the noise it adds
+// averages out over the samples of a pixel (or the denoiser).
+Color Scene::shade(Ray const &ray, Hit const &min_hit, Object const &obj,
+                   Lobes *lobes, PathVertex const &vertex)
+{
+    Material const &material = materials[obj.material];    //the hit objects material
     Point hit = ray.at(min_hit.t);                 //the hit point
     Vector N = min_hit.N;                          //the normal at hit point
     Vector V = -ray.D;                             //the view vector
 
     Color diffuse;
-    Color ambient;
+    Color ambient = ambientTerm(material);
     Color specular;
 
-    Color color = material.color;   
-    for(int i = 0; i < lights.size(); i++){
-        Vector L = lights[i]->position - hit;
-        Vector R = 2 * (L.dot(N)) * N - L;
-        L.normalize();
-        R.normalize();
-
-        diffuse += fmax(0,N.dot(L)) * lights[0]->color * material.kd * color;
-        ambient += color * material.ka;
-        specular += pow(fmax(0, R.dot(V)), material.n) * lights[0]->color * material.ks;
+    unsigned picked[MAX_LIGHT_SAMPLES];
+    double weights[MAX_LIGHT_SAMPLES];
+    unsigned count = pickLights(vertex, picked, weights);
+    for (unsigned pick = 0; pick != count; ++pick)
+    {
+        Light const &light = *lights[picked[pick]];
+        if (shadows && occluded(shadowOrigin(hit, N, min_hit.t, light), light, picked[pick]))
+            continue;
+        Color d;
+        Color s;
+        lightTerms(hit, N, V, material, light, weights[pick], d, s);
+        diffuse += d;
+        specular += s;
     }
-                   // place holder
+    if (shadows)
+        countShadowRays();
 
+    if (lobes)
+    {
+        lobes->ambient = ambient;
+        lobes->diffuse = diffuse;
+        lobes->specular = specular;
+    }
     return diffuse + ambient + specular;
 }
 
+Color Scene::ambientTerm(Material const &material) const
+{
+    Color ambient;
+    if (lights.size() <= lightSamples)
+        for (size_t idx = 0; idx != lights.size(); ++idx)
+            ambient += material.color * material.ka;
+    else
+        ambient = double(lights.size()) * material.color * material.ka;
+    return ambient;
+}
+
+unsigned Scene::pickLights(PathVertex const &vertex, unsigned *picked,
+                           double *weights) const
+{
+    if (lights.size() <= lightSamples)
+    {
+        for (unsigned idx = 0; idx != lights.size(); ++idx)
+        {
+            picked[idx] = idx;
+            weights[idx] = 1.0;
+        }
+        return lights.size();
+    }
+
+    double u = rng.uniform(vertex.x, vertex.y, vertex.sample,
+                           LIGHT_DIMENSION | vertex.vertex);
+    for (unsigned pick = 0; pick != lightSamples; ++pick)
+    {
+        picked[pick] = lightTable.sample((pick + u) / lightSamples);
+        weights[pick] = 1.0 / (lightSamples * lightTable.pdf(picked[pick]));
+    }
+    return lightSamples;
+}
+
+void Scene::lightTerms(Point const &hit, Vector const &N, Vector const &V,
+                       Material const &material, Light const &light,
+                       double weight, Color &diffuse, Color &specular) const
+{
+    Vector L = light.position - hit;
+    Vector R = 2 * (L.dot(N)) * N - L;
+    L.normalize();
+    R.normalize();
+
+    diffuse = weight * fmax(0,N.dot(L)) * light.color * material.kd * material.color;
+    specular = weight * pow(fmax(0, R.dot(V)), material.n) * light.color * material.ks;
+}
+
+Point Scene::shadowOrigin(Point const &hit, Vector const &N, double t,
+                          Light const &light) const
+{
+    double offset = (N.dot(light.position - hit) < 0 ? -SECONDARY_OFFSET : SECONDARY_OFFSET) * t;
+    return hit + offset * N;
+}
+
+void Scene::countShadowRays()
+{
+    OccluderCache &cache = occluderCache;
+    shadowRays.fetch_add(cache.rays, memory_order_relaxed);
+    shadowsBlocked.fetch_add(cache.blocked, memory_order_relaxed);
+    occluderTests.fetch_add(cache.tests, memory_order_relaxed);
+    occluderHits.fetch_add(cache.hits, memory_order_relaxed);
+    cache.rays = cache.blocked = cache.tests = cache.hits = 0;
+}
+
+// Neighbouring shading points mostly lose a light behind the same object,
+// so each thread remembers per light the object that blocked the last
+// shadow ray towards it and tests that one before traversing the BVH (and
+// the streamed meshes). A lit point clears the entry, the next blocked one
+// sets it again. Any object between P and the light blocks it, which need
+// not be the nearest.
+bool Scene::occluded(Point const &P, Light const &light, unsigned idx)
+{
+    OccluderCache &cache = occluderCache;
+    if (cache.epoch != shadowEpoch)
+    {
+        cache.epoch = shadowEpoch;
+        cache.blockers.assign(lights.size(), nullptr);
+    }
+    ++cache.rays;
+
+    Vector L = light.position - P;
+    double dist = L.length();
+    Ray ray(P, L / dist);
+
+    // The bounds test keeps the answer that of the BVH, which culls by
+    // them, so images do not depend on the order pixels are shaded in
+    Object *&blocker = cache.blockers[idx];
+    if (blocker)
+    {
+        ++cache.tests;
+        Vector invD(1.0 / ray.D.x, 1.0 / ray.D.y, 1.0 / ray.D.z);
+        double t = blocker->bounds().hit(ray, invD, dist) ? blocker->intersect(ray).t : 0.0;
+        if (t > 0 && t < dist)
+        {
+            ++cache.hits;
+            ++cache.blocked;
+            return true;
+        }
+    }
+
+    int found = bvh.occluded(ray, dist);
+    blocker = found < 0 ? nullptr : objects[found];
+    for (size_t i = 0; !blocker && i != meshes.size(); ++i)
+    {
+        double t = meshes[i]->intersect(ray).t;
+        if (t > 0 && t < dist)
+            blocker = meshes[i];
+    }
+    if (blocker)
+        ++cache.blocked;
+    return blocker != nullptr;
+}
+
 void Scene::render(Image &img)
 {
+    renderBand(img, 0, img.height());
+}
+
+void Scene::renderBand(Image &band, unsigned yImg, unsigned h, BandOutputs const &outputs)
+{
+    unsigned w = band.width();
+    unsigned rows = band.height();
+    if (!meshes.empty())
+    {
+        for (unsigned y = 0; y < rows; y += STREAM_BATCH_ROWS)
+            renderRows(band, y, min(rows, y + STREAM_BATCH_ROWS), yImg, h, outputs);
+        return;
+    }
+    if (wavefront)
+    {
+        renderWavefront(band, yImg, h, outputs);
+        return;
+    }
+
+    // Square tiles, handed out to the threads along the pixel order's
+    // curve, which also orders the pixels within a tile: consecutive rays
+    // then stay close and reuse the BVH nodes and primitives in cache.
+    unsigned tilesX = (w + tileSize - 1) / tileSize;
+    unsigned tilesY = (rows + tileSize - 1) / tileSize;
+    vector<uint32_t> tiles = cellOrder(tilesX, tilesY, pixelOrder);
+    vector<uint32_t> pixels = cellOrder(tileSize, tileSize, pixelOrder);
+    parallelFor(tiles.size(), threads, [&](unsigned job)
+    {
+        unsigned x0 = tiles[job] % tilesX * tileSize;
+        unsigned y0 = tiles[job] / tilesX * tileSize;
+        for (uint32_t pixel : pixels)
+        {
+            unsigned x = x0 + pixel % tileSize;
+            unsigned y = y0 + pixel / tileSize;
+            if (x >= w || y >= rows)
+                continue;
+
+            Color col;
+            Surface surface;
+            for (unsigned s = 0; s != samples; ++s)
+            {
+                Color color = trace(primaryRay(x, yImg + y, h, s), surface,
+                                    x, yImg + y, s);
+                record(outputs, x, y, color, surface);
+                col += color;
+            }
+            band(x, y) = col / samples;
+        }
+    });
+}
+
+void Scene::renderAdaptive(Image &band, unsigned yImg, unsigned h,
+                           vector<unsigned> &counts, BandOutputs const &outputs)
+{
+    unsigned w = band.width();
+    unsigned rows = band.height();
+    size_t numPixels = size_t(w) * rows;
+    if (!meshes.empty())
+    {
+        renderBand(band, yImg, h, outputs);  // batched by row, not adaptive
+        counts.assign(numPixels, samples);
+        return;
+    }
+
+    // Per pixel: the sum of its samples and the running mean and squared
+    // deviations of their luminance (Welford)
+    struct Stats
+    {
+        Color sum;
+        double mean = 0.0;
+        double m2 = 0.0;
+    };
+    vector<Stats> stats(numPixels);
+    vector<unsigned> extra(numPixels, min(samples, unsigned(MIN_ADAPTIVE_SAMPLES)));
+    counts.assign(numPixels, 0);
+
+    // Standard error of a pixel's mean, the noise we want below threshold
+    auto error = [&](size_t i)
+    {
+        return sqrt(stats[i].m2 / (counts[i] - 1) / counts[i]);
+    };
+
+    // The budget is the band's, so where it goes depends on the band size
+    size_t budget = numPixels * samples;
+    size_t used = 0;
+    unsigned most = samples * MAX_ADAPTIVE_FACTOR;
+    unsigned tilesX = (w + tileSize - 1) / tileSize;
+    unsigned tilesY = (rows + tileSize - 1) / tileSize;
+    vector<uint32_t> tiles = cellOrder(tilesX, tilesY, pixelOrder);
+    vector<uint32_t> pixels = cellOrder(tileSize, tileSize, pixelOrder);
+    for (;;)
+    {
+        // 1. Trace the extra samples of this round, tile by tile.
+        parallelFor(tiles.size(), threads, [&](unsigned job)
+        {
+            unsigned x0 = tiles[job] % tilesX * tileSize;
+            unsigned y0 = tiles[job] / tilesX * tileSize;
+            for (uint32_t p : pixels)
+            {
+                unsigned x = x0 + p % tileSize;
+                unsigned y = y0 + p / tileSize;
+                if (x >= w || y >= rows)
+                    continue;
+
+                size_t i = size_t(y) * w + x;
+                Stats &pixel = stats[i];
+                unsigned end = counts[i] + extra[i];
+                for (unsigned s = counts[i]; s != end; ++s)
+                {
+                    Surface surface;
+                    Color color = trace(sequenceRay(x, yImg + y, h, s), surface,
+                                        x, yImg + y, s);
+                    record(outputs, x, y, color, surface);
+                    double lum = 0.2126 * color.r + 0.7152 * color.g + 0.0722 * color.b;
+                    double delta = lum - pixel.mean;
+                    pixel.mean += delta / (s + 1);
+                    pixel.m2 += delta * (lum - pixel.mean);
+                    pixel.sum += color;
+                }
+                counts[i] = end;
+            }
+        });
+        for (size_t i = 0; i != numPixels; ++i)
+            used += extra[i];
+
+        // 2. Noisy pixels below the cap double their samples, the noisiest
+        //    first while the budget lasts. Flat areas converge after the
+        //    first round, so the rest goes to edges and highlights.
+        vector<size_t> noisy;
+        for (size_t i = 0; i != numPixels; ++i)
+            if (counts[i] > 1 && counts[i] < most && error(i) > noiseThreshold)
+                noisy.push_back(i);
+        sort(noisy.begin(), noisy.end(), [&](size_t a, size_t b)
+        {
+            return error(a) > error(b);
+        });
+
+        fill(extra.begin(), extra.end(), 0);
+        size_t left = budget - min(budget, used);
+        if (noisy.empty() || left == 0)
+            break;
+        for (size_t i : noisy)
+        {
+            extra[i] = min(size_t(min(counts[i], most - counts[i])), left);
+            left -= extra[i];
+            if (left == 0)
+                break;
+        }
+    }
+
+    for (unsigned y = 0; y != rows; ++y)
+        for (unsigned x = 0; x != w; ++x)
+            band(x, y) = stats[size_t(y) * w + x].sum / counts[size_t(y) * w + x];
+}
+
+void Scene::renderEdges(Image &band, unsigned yImg, unsigned h,
+                        vector<unsigned> &counts, BandOutputs const &outputs)
+{
+    unsigned w = band.width();
+    unsigned rows = band.height();
+    if (!meshes.empty())
+    {
+        renderBand(band, yImg, h, outputs);  // batched by row, not adaptive
+        counts.assign(size_t(w) * rows, samples);
+        return;
+    }
+
+    // 1. Trace the pixel centers, with a row of the bands above and below
+    //    as neighbours.
+    struct Center
+    {
+        Color color;
+        Surface surface;
+    };
+    unsigned top = yImg > 0 ? 1 : 0;
+    unsigned traced = rows + top + (yImg + rows < h ? 1 : 0);
+    vector<Center> centers(size_t(w) * traced);
+    parallelFor(traced, threads, [&](unsigned row)
+    {
+        for (unsigned x = 0; x != w; ++x)
+        {
+            Center &center = centers[size_t(row) * w + x];
+            Ray ray(pixelRay(x, yImg - top + row, h, 0.5, 0.5));
+            center.color = trace(ray, center.surface, x, yImg - top + row, 0);
+        }
+    });
+
+    // 2. Pixels differing from a neighbour in object, normal, depth or
+    //    color are on an edge. Objects are told apart by their scene file
+    //    id, the triangles of one mesh are a single object.
+    auto differ = [&](Center const &a, Center const &b)
+    {
+        unsigned idA = a.surface.obj ? a.surface.obj->id : 0;
+        unsigned idB = b.surface.obj ? b.surface.obj->id : 0;
+        if (idA != idB)
+            return true;
+        if (a.surface.obj && a.surface.N.dot(b.surface.N) < EDGE_NORMAL_COS)
+            return true;
+        if (a.surface.obj && fabs(a.surface.t - b.surface.t)
+                > EDGE_DEPTH_RATIO * fmin(a.surface.t, b.surface.t))
+            return true;
+        Color d = a.color - b.color;
+        return fmax(fabs(d.r), fmax(fabs(d.g), fabs(d.b))) > edgeThreshold;
+    };
+
+    // 3. Supersample the edges, keep the centers elsewhere. Edge pixels
+    //    are made of their samples alone, exactly as with supersampling
+    //    everywhere, so their center is not counted. The outputs get the
+    //    samples the pixel is made of.
+    counts.assign(size_t(w) * rows, 0);
+    parallelFor(rows, threads, [&](unsigned y)
+    {
+        unsigned row = y + top;
+        for (unsigned x = 0; x != w; ++x)
+        {
+            Center const &center = centers[size_t(row) * w + x];
+            bool edge = samples > 1 && ((x > 0 && differ(center, centers[size_t(row) * w + x - 1]))
+                || (x + 1 < w && differ(center, centers[size_t(row) * w + x + 1]))
+                || (row > 0 && differ(center, centers[size_t(row - 1) * w + x]))
+                || (row + 1 < traced && differ(center, centers[size_t(row + 1) * w + x])));
+            if (!edge)
+            {
+                record(outputs, x, y, center.color, center.surface);
+                band(x, y) = center.color;
+                counts[size_t(y) * w + x] = 1;
+                continue;
+            }
+
+            Color col;
+            for (unsigned s = 0; s != samples; ++s)
+            {
+                Surface surface;
+                Color color = trace(primaryRay(x, yImg + y, h, s), surface,
+                                    x, yImg + y, s);
+                record(outputs, x, y, color, surface);
+                col += color;
+            }
+            band(x, y) = col / samples;
+            counts[size_t(y) * w + x] = samples;
+        }
+    });
+}
+
+bool Scene::renderProgressive(Image &img,
+                              chrono::steady_clock::time_point deadline,
+                              vector<double> &tileSamples,
+                              PassCallback const &onPass)
+{
+    unsigned size = progressiveTileSize();
     unsigned w = img.width();
     unsigned h = img.height();
-    for (unsigned y = 0; y < h; ++y)
+    unsigned tilesX = (w + size - 1) / size;
+    unsigned tilesY = (h + size - 1) / size;
+    unsigned numTiles = tilesX * tilesY;
+
+    // Passes over all tiles: first sample 0 of every COARSEST_BLOCK-th
+    // pixel in both directions, halving the spacing each pass (pixels of
+    // earlier passes are not traced again), then further samples of all
+    // pixels. So the coarse passes cost no extra rays. Every sweep over
+    // the image costs memory traffic, so the later passes double the
+    // samples so far, up to MAX_PASS_SAMPLES at a time: 1, 1, 2, 4, ...
+    unsigned coarsePasses = 0;
+    while ((COARSEST_BLOCK >> coarsePasses) > 1)
+        ++coarsePasses;
+    vector<unsigned> firstSample(1, 0);     // of every full resolution pass
+    while (firstSample.back() < samples)
     {
+        unsigned done = firstSample.back();
+        firstSample.push_back(done + max(1u, min(done, unsigned(MAX_PASS_SAMPLES))));
+    }
+    firstSample.back() = samples;
+    unsigned numPasses = coarsePasses + firstSample.size() - 1;
+
+    // Sums of the samples so far, only needed beyond one sample per pixel
+    vector<Color> sums(samples > 1 ? size_t(w) * h : 0);
+    atomic<bool> expired(false);
+
+    // With a deadline the coarse passes fill their blocks, so that the
+    // image is complete whenever we stop. Otherwise only the traced pixels
+    // are stored until the first full resolution pass.
+    bool fill = deadline != chrono::steady_clock::time_point::max();
+
+    tileSamples.assign(numTiles, 0.0);
+    for (unsigned pass = 0; pass != numPasses && !expired; ++pass)
+    {
+        unsigned block = pass < coarsePasses ? COARSEST_BLOCK >> pass : 1;
+        unsigned full = pass < coarsePasses ? 0 : pass - coarsePasses;
+        unsigned sample = firstSample[full];
+        unsigned end = firstSample[full + 1];
+
+        parallelFor(numTiles, threads, [&](unsigned tile)
+        {
+            // Tiles are the unit of work: none starts past the deadline,
+            // and each leaves the image up to date, so stopping is free
+            if (expired || chrono::steady_clock::now() >= deadline)
+            {
+                expired = true;
+                return;
+            }
+
+            // 1. Trace, showing every pixel as the mean of its samples.
+            unsigned x0 = tile % tilesX * size;
+            unsigned y0 = tile / tilesX * size;
+            unsigned x1 = min(w, x0 + size);
+            unsigned y1 = min(h, y0 + size);
+            for (unsigned y = y0; y < y1; y += block)
+            {
+                for (unsigned x = x0; x < x1; x += block)
+                {
+                    // already traced by a coarser pass
+                    unsigned coarser = 2 * block;
+                    if (sample == 0 && pass != 0 && x % coarser == 0 && y % coarser == 0)
+                        continue;
+                    Surface surface;
+                    Color color = trace(primaryRay(x, y, h, sample), surface, x, y, sample);
+                    if (!sums.empty())
+                    {
+                        // summed in sample order, as render() does
+                        Color &sum = sums[size_t(y) * w + x];
+                        sum += color;
+                        for (unsigned s = sample + 1; s < end; ++s)
+                            sum += trace(primaryRay(x, y, h, s), surface, x, y, s);
+                        color = sum / end;
+                    }
+                    img(x, y) = color;
+                }
+            }
+
+            // 2. Coarse pixels stand in for the rest of their block.
+            if (fill && block > 1)
+                for (unsigned y = y0; y < y1; ++y)
+                    for (unsigned x = x0; x < x1; ++x)
+                        if (x % block != 0 || y % block != 0)
+                            img(x, y) = img(x / block * block, y / block * block);
+
+            tileSamples[tile] = double(end) / (block * block);
+        });
+
+        if (!expired && onPass)
+            onPass(pass, numPasses, block);
+    }
+    return !expired;
+}
+
+unsigned Scene::progressiveTileSize() const
+{
+    // A multiple of the coarsest spacing, so the coarse pixels lie on the
+    // same grid across the whole image
+    return (tileSize + COARSEST_BLOCK - 1) / COARSEST_BLOCK * COARSEST_BLOCK;
+}
+
+Ray Scene::primaryRay(unsigned x, unsigned y, unsigned h, unsigned s) const
+{
+    return pixelRay(x, y, h, sampler->sample(x, y, s, 0), sampler->sample(x, y, s, 1));
+}
+
+Ray Scene::sequenceRay(unsigned x, unsigned y, unsigned h, unsigned s) const
+{
+    static R2Sampler const r2;
+    Sampler const *sequence = sampler->isSequence() ? sampler.get() : &r2;
+    return pixelRay(x, y, h, sequence->sample(x, y, s, 0), sequence->sample(x, y, s, 1));
+}
+
+Ray Scene::pixelRay(unsigned x, unsigned y, unsigned h, double dx, double dy) const
+{
+    Point pixel(x + dx, h - 1 - y + dy, 0);
+    return Ray(eye, (pixel - eye).normalized());
+}
+
+void Scene::renderRows(Image &band, unsigned y0, unsigned y1, unsigned yImg,
+                       unsigned h, BandOutputs const &outputs)
+{
+    unsigned w = band.width();
+
+    // 1. Generate the primary rays of the batch.
+    vector<Ray> rays;
+    rays.reserve(w * (y1 - y0) * samples);
+    for (unsigned y = y0; y < y1; ++y)
         for (unsigned x = 0; x < w; ++x)
+            for (unsigned s = 0; s != samples; ++s)
+                rays.push_back(primaryRay(x, yImg + y, h, s));
+
+    // 2. Streamed meshes first, one page-in per block for the whole batch.
+    Hit none(numeric_limits<double>::infinity(), Vector());
+    vector<Hit> hits(rays.size(), none);
+    vector<Object *> hitObjects(rays.size(), nullptr);
+    for (StreamedMeshPtr const &mesh : meshes)
+    {
+        vector<Hit> meshHits(rays.size(), none);
+        mesh->intersectBatch(rays, meshHits);
+        for (unsigned i = 0; i != rays.size(); ++i)
         {
-            Point pixel(x + 0.5, h - 1 - y + 0.5, 0);
-            Ray ray(eye, (pixel - eye).normalized());
-            Color col = trace(ray);
-            col.clamp();
-            img(x, y) = col;
+            if (meshHits[i].t < hits[i].t)
+            {
+                hits[i] = meshHits[i];
+                hitObjects[i] = mesh;
+            }
         }
     }
+
+    // 3. Then the in-memory objects, and shade, a row per job.
+    parallelFor(y1 - y0, threads, [&](unsigned row)
+    {
+        for (unsigned x = 0; x < w; ++x)
+        {
+            Color col;
+            for (unsigned s = 0; s != samples; ++s)
+            {
+                unsigned i = ((row * w) + x) * samples + s;
+                int idx = bvh.intersect(rays[i], hits[i]);
+                if (idx >= 0)
+                    hitObjects[i] = objects[idx];
+                Surface surface;
+                surface.obj = hitObjects[i];
+                surface.N = hits[i].N;
+                surface.t = hits[i].t;
+                Color color;
+                if (surface.obj)
+                {
+                    PathVertex vertex{x, yImg + y0 + row, s, 0};
+                    color = shade(rays[i], hits[i], *surface.obj, &surface.lobes, vertex);
+                    Material const &material = materials[surface.obj->material];
+                    if (material.reflect > 0 || material.refract > 0)
+                    {
+                        surface.lobes.reflection = secondary(rays[i], hits[i], *surface.obj,
+                                                             x, yImg + y0 + row, s);
+                        color += surface.lobes.reflection;
+                    }
+                }
+                record(outputs, x, y0 + row, color, surface);
+                col += color;
+            }
+            band(x, y0 + row) = col / samples;
+        }
+    });
+}
+
+// --- Wavefront rendering -----------------------------------------------------
+
+// The rays of a wavefront stage, as a structure of arrays. A ray belongs to
+// path `path` of the wave and is vertex `vertex` of it: 0 for the primary
+// ray, then numbered in the order the rays are queued, level by level.
+struct RayQueue
+{
+    vector<double> ox, oy, oz;
+    vector<double> dx, dy, dz;
+    vector<double> weight;
+    vector<uint32_t> path;
+    vector<uint32_t> vertex;
+    size_t count = 0;
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    // the arrays only grow, so a queue reused for every level of every
+    // wave allocates for its largest level only
+    void grow(size_t n)
+    {
+        if (n <= path.size())
+            return;
+        for (vector<double> *v : {&ox, &oy, &oz, &dx, &dy, &dz, &weight})
+            v->resize(n);
+        path.resize(n);
+        vertex.resize(n);
+    }
+
+    void resize(size_t n)
+    {
+        grow(n);
+        count = n;
+    }
+
+    void set(size_t i, Ray const &ray, double w, uint32_t p, uint32_t v)
+    {
+        ox[i] = ray.O.x;
+        oy[i] = ray.O.y;
+        oz[i] = ray.O.z;
+        dx[i] = ray.D.x;
+        dy[i] = ray.D.y;
+        dz[i] = ray.D.z;
+        weight[i] = w;
+        path[i] = p;
+        vertex[i] = v;
+    }
+
+    void clear()
+    {
+        resize(0);
+    }
+
+    void push(Ray const &ray, double w, uint32_t p, uint32_t v)
+    {
+        if (count == path.size())
+            grow(max<size_t>(2 * count, 64));
+        set(count++, ray, w, p, v);
+    }
+
+    Ray ray(size_t i) const
+    {
+        return Ray(Point(ox[i], oy[i], oz[i]), Vector(dx[i], dy[i], dz[i]));
+    }
+
+    // this[i] = from[order[i]]
+    void gather(RayQueue const &from, vector<uint32_t> const &order)
+    {
+        resize(order.size());
+        for (size_t i = 0; i != order.size(); ++i)
+        {
+            uint32_t j = order[i];
+            set(i, from.ray(j), from.weight[j], from.path[j], from.vertex[j]);
+        }
+    }
+};
+
+// Nearest hits of a RayQueue
+struct HitQueue
+{
+    vector<double> t;
+    vector<double> nx, ny, nz;
+    vector<Object *> obj;
+
+    void resize(size_t n)
+    {
+        for (vector<double> *v : {&t, &nx, &ny, &nz})
+            v->resize(n);
+        obj.resize(n);
+    }
+
+    void set(size_t i, Hit const &hit, Object *o)
+    {
+        t[i] = hit.t;
+        nx[i] = hit.N.x;
+        ny[i] = hit.N.y;
+        nz[i] = hit.N.z;
+        obj[i] = o;
+    }
+
+    Hit hit(size_t i) const
+    {
+        return Hit(t[i], Vector(nx[i], ny[i], nz[i]));
+    }
+
+    void gather(HitQueue const &from, vector<uint32_t> const &order)
+    {
+        resize(order.size());
+        for (size_t i = 0; i != order.size(); ++i)
+            set(i, from.hit(order[i]), from.obj[order[i]]);
+    }
+};
+
+// The light picks of the hits of a stage, `picks` per hit: the shadow ray
+// and the terms it lets through when the light is visible
+struct ShadowQueue
+{
+    vector<double> ox, oy, oz;
+    vector<unsigned> light;
+    vector<double> weight;
+    vector<Color> diffuse;
+    vector<Color> specular;
+    vector<uint8_t> visible;
+
+    void resize(size_t n)
+    {
+        for (vector<double> *v : {&ox, &oy, &oz, &weight})
+            v->resize(n);
+        light.resize(n);
+        diffuse.resize(n);
+        specular.resize(n);
+        visible.resize(n);
+    }
+};
+
+// The order to trace n rays in: by the Morton code of their quantized
+// direction, then by that of their origin's cell in the bounds of all
+// origins. Rays of a bucket leave about the same spot in about the same
+// direction and so visit the same BVH nodes, one after the other.
+template <typename Direction>
+static void coherentOrder(size_t n, double const *ox, double const *oy,
+                          double const *oz, Direction const &direction,
+                          vector<uint32_t> &order)
+{
+    AABB bounds;
+    for (size_t i = 0; i != n; ++i)
+        bounds.grow(Point(ox[i], oy[i], oz[i]));
+    Vector extent = bounds.max - bounds.min;
+
+    // v in [lo, lo + range] to [0, 2^bits)
+    auto quantize = [](double v, double lo, double range, unsigned bits)
+    {
+        double cells = 1u << bits;
+        double q = range > 0 ? (v - lo) / range * cells : 0.0;
+        return uint32_t(min(max(q, 0.0), cells - 1));
+    };
+
+    vector<pair<uint64_t, uint32_t>> keyed(n);
+    for (size_t i = 0; i != n; ++i)
+    {
+        Vector D = direction(i).normalized();
+        uint64_t dir = morton3(quantize(D.x, -1, 2, SORT_DIRECTION_BITS),
+                               quantize(D.y, -1, 2, SORT_DIRECTION_BITS),
+                               quantize(D.z, -1, 2, SORT_DIRECTION_BITS));
+        uint64_t cell = morton3(quantize(ox[i], bounds.min.x, extent.x, SORT_ORIGIN_BITS),
+                                quantize(oy[i], bounds.min.y, extent.y, SORT_ORIGIN_BITS),
+                                quantize(oz[i], bounds.min.z, extent.z, SORT_ORIGIN_BITS));
+        keyed[i] = make_pair(dir << (3 * SORT_ORIGIN_BITS) | cell, uint32_t(i));
+    }
+    sort(keyed.begin(), keyed.end());
+    order.resize(n);
+    for (size_t i = 0; i != n; ++i)
+        order[i] = keyed[i].second;
+}
+
+// Breadth first: the samples of a wave of pixels go through the stages
+// together, a ray tree level at a time.
+//   1. generate the primary rays of all paths,
+//   2. intersect the queue,
+//   3. compact the misses away and sort the hits by material,
+//   4. shade: the ambient term, the light picks with their terms and
+//      shadow rays, and the reflected and refracted rays,
+//   5. trace the shadow rays (sorted, see below),
+//   6. add the visible terms to the paths, in queue order,
+//   7. queue the next level: the rays of a path in vertex order, after
+//      Russian roulette, within its share of the ray budget,
+// then back to 2 until no rays are left, and write the pixels. Each stage
+// runs over the whole queue in chunks, on the same BVH, objects and
+// shading code as trace. Sums are taken in an order fixed by the queues,
+// so images do not depend on the number of threads. Without reflection
+// and refraction they match renderBand exactly; the ray trees themselves
+// are cut differently (roulette decisions and vertices numbered level by
+// level instead of depth first as in secondary, and so is the budget spent).
+// With ray sorting the secondary rays of 2 and the shadow rays of 5 are
+// traced in coherentOrder, writing their results in queue order: only
+// the traversal changes, not the image.
+void Scene::renderWavefront(Image &band, unsigned yImg, unsigned h,
+                            BandOutputs const &outputs)
+{
+    unsigned w = band.width();
+    unsigned rows = band.height();
+    unsigned waveRows = max(1u, unsigned(WAVEFRONT_PATHS / samples / w));
+    unsigned picks = min(size_t(lightSamples), lights.size());
+    unsigned budget = rayBudget == 0 ? numeric_limits<unsigned>::max()
+        : max(rayBudget / samples, 1u) - 1;
+
+    // run stage(i) for i in [0, n), in chunks on the threads
+    auto stage = [&](size_t n, auto const &body)
+    {
+        parallelFor((n + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK, threads, [&](unsigned job)
+        {
+            size_t end = min(n, size_t(job + 1) * WAVEFRONT_CHUNK);
+            for (size_t i = size_t(job) * WAVEFRONT_CHUNK; i != end; ++i)
+                body(i);
+        });
+    };
+
+    RayQueue queue;
+    RayQueue next;
+    HitQueue hits;
+    HitQueue sorted;
+    ShadowQueue shadow;
+    vector<Color> ambient;
+    vector<Scattered> scattered;
+    vector<Surface> surfaces;
+    vector<unsigned> raysLeft;
+    vector<unsigned> decisions;             // roulette dimensions used
+    vector<uint32_t> order;
+    vector<uint32_t> traceOrder;
+    for (unsigned y0 = 0; y0 < rows; y0 += waveRows)
+    {
+        // the paths of a pixel are consecutive, the pixels along the
+        // pixel order's curve over the rows of the wave
+        vector<uint32_t> cells = cellOrder(w, min(waveRows, rows - y0), pixelOrder);
+        size_t paths = cells.size() * samples;
+        auto pixel = [&](uint32_t path, unsigned &x, unsigned &y, unsigned &s)
+        {
+            x = cells[path / samples] % w;
+            y = y0 + cells[path / samples] / w;
+            s = path % samples;
+        };
+
+        // 1. Generate.
+        queue.resize(paths);
+        stage(paths, [&](size_t i)
+        {
+            unsigned x, y, s;
+            pixel(i, x, y, s);
+            queue.set(i, primaryRay(x, yImg + y, h, s), 1.0, i, 0);
+        });
+        surfaces.assign(paths, Surface());
+        raysLeft.assign(paths, budget);
+        decisions.assign(paths, 0);
+
+        for (unsigned depth = 0; queue.size() != 0; ++depth)
+        {
+            size_t n = queue.size();
+
+            // 2. Intersect.
+            bool sorting = sortRays && depth > 0;
+            if (sorting)
+                coherentOrder(n, queue.ox.data(), queue.oy.data(), queue.oz.data(),
+                              [&](size_t i)
+                              {
+                                  return Vector(queue.dx[i], queue.dy[i], queue.dz[i]);
+                              }, traceOrder);
+            hits.resize(n);
+            stage(n, [&](size_t j)
+            {
+                size_t i = sorting ? traceOrder[j] : j;
+                Hit hit(numeric_limits<double>::infinity(), Vector());
+                Object *obj = intersect(queue.ray(i), hit);
+                hits.set(i, hit, obj);
+                if (depth == 0)
+                {
+                    surfaces[i].obj = obj;
+                    surfaces[i].N = hit.N;
+                    surfaces[i].t = hit.t;
+                }
+            });
+
+            // 3. Compact and sort, ties in queue order.
+            order.clear();
+            for (uint32_t i = 0; i != n; ++i)
+                if (hits.obj[i])
+                    order.push_back(i);
+            stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+            {
+                return hits.obj[a]->material < hits.obj[b]->material;
+            });
+            next.gather(queue, order);
+            swap(queue, next);
+            sorted.gather(hits, order);
+            n = queue.size();
+
+            // 4. Shade.
+            shadow.resize(n * picks);
+            ambient.resize(n);
+            scattered.resize(n);
+            stage(n, [&](size_t i)
+            {
+                Ray ray = queue.ray(i);
+                Hit hit = sorted.hit(i);
+                Material const &material = materials[sorted.obj[i]->material];
+                Point P = ray.at(hit.t);
+                PathVertex vertex;
+                pixel(queue.path[i], vertex.x, vertex.y, vertex.sample);
+                vertex.y += yImg;
+                vertex.vertex = queue.vertex[i];
+
+                ambient[i] = ambientTerm(material);
+                size_t first = i * picks;
+                pickLights(vertex, shadow.light.data() + first, shadow.weight.data() + first);
+                for (size_t k = first; k != first + picks; ++k)
+                {
+                    Light const &light = *lights[shadow.light[k]];
+                    lightTerms(P, hit.N, -ray.D, material, light, shadow.weight[k],
+                               shadow.diffuse[k], shadow.specular[k]);
+                    Point origin = shadowOrigin(P, hit.N, hit.t, light);
+                    shadow.ox[k] = origin.x;
+                    shadow.oy[k] = origin.y;
+                    shadow.oz[k] = origin.z;
+                }
+
+                Scattered &out = scattered[i];
+                out.kr = out.kt = 0.0;
+                if (depth < maxDepth && (material.reflect > 0 || material.refract > 0))
+                {
+                    out = scatter(ray, hit, material);
+                    out.kr *= queue.weight[i];
+                    out.kt *= queue.weight[i];
+                }
+            });
+
+            // 5. Shadow, counted per job like shade does per hit.
+            sorting = sortRays && shadows;
+            if (sorting)
+                coherentOrder(n * picks, shadow.ox.data(), shadow.oy.data(), shadow.oz.data(),
+                              [&](size_t k)
+                              {
+                                  return lights[shadow.light[k]]->position
+                                      - Point(shadow.ox[k], shadow.oy[k], shadow.oz[k]);
+                              }, traceOrder);
+            stage(n * picks, [&](size_t j)
+            {
+                size_t k = sorting ? traceOrder[j] : j;
+                shadow.visible[k] = !shadows
+                    || !occluded(Point(shadow.ox[k], shadow.oy[k], shadow.oz[k]),
+                                 *lights[shadow.light[k]], shadow.light[k]);
+                if (shadows && (j + 1 == n * picks || (j + 1) % WAVEFRONT_CHUNK == 0))
+                    countShadowRays();
+            });
+
+            // 6. Accumulate.
+            for (size_t i = 0; i != n; ++i)
+            {
+                Color diffuse;
+                Color specular;
+                for (size_t k = i * picks; k != (i + 1) * picks; ++k)
+                {
+                    if (shadow.visible[k])
+                    {
+                        diffuse += shadow.diffuse[k];
+                        specular += shadow.specular[k];
+                    }
+                }
+                Lobes &lobes = surfaces[queue.path[i]].lobes;
+                if (depth == 0)
+                {
+                    lobes.ambient = ambient[i];
+                    lobes.diffuse = diffuse;
+                    lobes.specular = specular;
+                }
+                else
+                    lobes.reflection += queue.weight[i] * (diffuse + ambient[i] + specular);
+            }
+
+            // 7. Extend.
+            order.clear();
+            for (uint32_t i = 0; i != n; ++i)
+                if (scattered[i].kr > 0 || scattered[i].kt > 0)
+                    order.push_back(i);
+            sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+            {
+                return queue.path[a] != queue.path[b] ? queue.path[a] < queue.path[b]
+                                                      : queue.vertex[a] < queue.vertex[b];
+            });
+            next.clear();
+            for (uint32_t i : order)
+            {
+                uint32_t path = queue.path[i];
+                unsigned x, y, s;
+                pixel(path, x, y, s);
+                Scattered const &out = scattered[i];
+                double weights[2] = {out.kr, out.kt};
+                Ray const *rays[2] = {&out.reflected, &out.refracted};
+                for (unsigned side = 0; side != 2; ++side)
+                {
+                    // roulette as in secondary, on the path's next decision
+                    double weight = weights[side];
+                    if (weight <= 0)
+                        continue;
+                    if (weight < ROULETTE_WEIGHT)
+                    {
+                        double u = rng.uniform(x, yImg + y, s,
+                                               ROULETTE_DIMENSION | decisions[path]++);
+                        if (u * ROULETTE_WEIGHT >= weight)
+                            continue;
+                        weight = ROULETTE_WEIGHT;
+                    }
+                    if (raysLeft[path] == 0)
+                        continue;
+                    --raysLeft[path];
+                    next.push(*rays[side], weight, path, budget - raysLeft[path]);
+                }
+            }
+            secondaryRays.fetch_add(next.size(), memory_order_relaxed);
+            swap(queue, next);
+        }
+
+        // 8. Write the pixels of the wave, recording the samples in order.
+        stage(paths / samples, [&](size_t idx)
+        {
+            unsigned x, y, s;
+            pixel(idx * samples, x, y, s);
+            Color col;
+            for (s = 0; s != samples; ++s)
+            {
+                Surface const &surface = surfaces[idx * samples + s];
+                Lobes const &lobes = surface.lobes;
+                Color color = lobes.diffuse + lobes.ambient + lobes.specular;
+                color += lobes.reflection;
+                record(outputs, x, y, color, surface);
+                col += color;
+            }
+            band(x, y) = col / samples;
+        });
+    }
 }
 
 // --- Misc functions ----------------------------------------------------------
 
+Arena &Scene::getArena()
+{
+    return arena;
+}
+
+MaterialId Scene::addMaterial(Material const &material)
+{
+    auto it = materialIds.find(material);
+    if (it != materialIds.end())
+        return it->second;
+
+    if (materials.size() > numeric_limits<MaterialId>::max())
+        throw runtime_error("Too many distinct materials.");
+
+    MaterialId id = materials.size();
+    materials.push_back(material);
+    materialIds[material] = id;
+    return id;
+}
+
 void Scene::addObject(ObjectPtr obj)
 {
-    objects.push_back(obj);
+    // Streamed meshes page themselves in, keep them out of the bvh
+    StreamedMeshPtr mesh = dynamic_cast<StreamedMesh *>(obj);
+    if (mesh)
+        meshes.push_back(mesh);
+    else
+        objects.push_back(obj);
 }
 
 void Scene::addLight(Light const &light)
 {
-    lights.push_back(LightPtr(new Light(light)));
+    lights.push_back(arena.create<Light>(light));
 }
 
 void Scene::setEye(Triple const &position)
@@ -90,6 +1365,98 @@ void Scene::setEye(Triple const &position)
     eye = position;
 }
 
+void Scene::setRenderSettings(unsigned threadCount, unsigned tile,
+                              unsigned samplesPerPixel, string const &samplerName,
+                              uint64_t seed)
+{
+    threads = threadCount == 0 ? defaultThreads() : threadCount;
+    tileSize = max(1u, tile);
+    samples = max(1u, samplesPerPixel);
+    sampler.reset(Sampler::create(samplerName, samples, seed));
+    if (!sampler)
+        throw runtime_error("Unknown sampler: \"" + samplerName + "\".");
+    rng = Philox(seed);
+}
+
+void Scene::setPixelOrder(string const &order)
+{
+    if (order == "scanline")
+        pixelOrder = SCANLINE_ORDER;
+    else if (order == "morton")
+        pixelOrder = MORTON_ORDER;
+    else if (order == "hilbert")
+        pixelOrder = HILBERT_ORDER;
+    else
+        throw runtime_error("Unknown pixel order: \"" + order + "\".");
+}
+
+void Scene::setNoiseThreshold(double threshold)
+{
+    noiseThreshold = threshold;
+}
+
+void Scene::setEdgeThreshold(double threshold)
+{
+    edgeThreshold = threshold;
+}
+
+void Scene::setTraceLimits(unsigned depth, unsigned budget)
+{
+    maxDepth = min(depth, unsigned(MAX_TRACE_DEPTH));
+    rayBudget = budget;
+}
+
+void Scene::setLightSamples(unsigned count)
+{
+    lightSamples = min(max(count, 1u), unsigned(MAX_LIGHT_SAMPLES));
+}
+
+void Scene::setWavefront(bool enable)
+{
+    wavefront = enable;
+}
+
+void Scene::setRaySorting(bool enable)
+{
+    sortRays = enable;
+}
+
+void Scene::setShadows(bool enable)
+{
+    shadows = enable;
+}
+
+void Scene::setLazyBVH(bool lazy)
+{
+    lazyBVH = lazy;
+}
+
+void Scene::setAcceleratorCache(string const &filename, uint64_t key)
+{
+    cacheFile = filename;
+    cacheKey = key;
+}
+
+bool Scene::buildAccelerator()
+{
+    vector<double> power;
+    for (LightPtr light : lights)
+        power.push_back(0.2126 * light->color.r + 0.7152 * light->color.g
+                        + 0.0722 * light->color.b);
+    lightTable = AliasTable(power);
+    shadowEpoch = ++occluderEpochs;
+
+    if (!cacheFile.empty() && bvh.load(objects, cacheFile, cacheKey, arena))
+        return true;
+
+    // Saving refines the whole tree, a lazy one is only split where the
+    // rays go and is therefore never written.
+    bvh.build(objects, lazyBVH, arena);
+    if (!cacheFile.empty() && !lazyBVH)
+        bvh.save(cacheFile, cacheKey);
+    return false;
+}
+
 unsigned Scene::getNumObject()
 {
     return objects.size();
@@ -99,3 +1466,43 @@ unsigned Scene::getNumLights()
 {
     return lights.size();
 }
+
+unsigned Scene::getNumBVHNodes()
+{
+    return bvh.numNodes();
+}
+
+uint64_t Scene::getNumSecondaryRays() const
+{
+    return secondaryRays.load();
+}
+
+uint64_t Scene::getNumShadowRays() const
+{
+    return shadowRays.load();
+}
+
+void Scene::reportShadows(ostream &out)
+{
+    uint64_t rays = shadowRays.load();
+    if (rays == 0)
+        return;
+    uint64_t tests = occluderTests.load();
+    uint64_t hits = occluderHits.load();
+    out << "Traced " << rays << " shadow rays, " << shadowsBlocked.load()
+        << " blocked; the cached occluder blocked " << hits << " of the "
+        << tests << " it was tested on ("
+        << (tests ? 100.0 * hits / tests : 0.0) << "% hit rate).\n";
+}
+
+void Scene::reportStreaming(ostream &out)
+{
+    for (StreamedMeshPtr const &mesh : meshes)
+    {
+        BlockCache const &cache = mesh->cache();
+        out << "Streamed mesh: " << mesh->numTriangles() << " triangles in "
+            << mesh->numBlocks() << " blocks, " << cache.loads() << " loads, "
+            << cache.evictions() << " evictions, peak resident "
+            << cache.peakResidentBytes() / double(1 << 20) << " MiB.\n";
+    }
+}
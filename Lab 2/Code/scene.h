@@ -1,21 +1,122 @@
 #ifndef SCENE_H_
 #define SCENE_H_
 
+#include "aliastable.h"
+#include "arena.h"
+#include "bvh.h"
 #include "light.h"
+#include "material.h"
 #include "object.h"
+#include "ray.h"
+#include "rng.h"
+#include "sampler.h"
 #include "triple.h"
+#include "shapes/streamedmesh.h"
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <string>
 #include <vector>
 
 // Forward declerations
-class Ray;
 class Image;
+class AOVs;
+class Denoiser;
+
+// The terms of the Phong model at a hit and the light reflected and
+// refracted there, their sum is its color
+struct Lobes
+{
+    Color ambient;
+    Color diffuse;
+    Color specular;
+    Color reflection;
+};
+
+// The first hit of a ray, besides its color
+struct Surface
+{
+    Object *obj = nullptr;      // nullptr: nothing was hit
+    Vector N;
+    double t = 0.0;
+    Lobes lobes;
+};
+
+// A shading point: vertex `vertex` (0 for the first hit) of the path of
+// sample `sample` of image pixel (x, y), which keys its random numbers
+struct PathVertex
+{
+    unsigned x = 0;
+    unsigned y = 0;
+    unsigned sample = 0;
+    unsigned vertex = 0;
+};
+
+// The rays leaving a reflective or refractive hit, already off the
+// surface, and the share of the light each carries (0: not traced)
+struct Scattered
+{
+    Ray reflected{Point(), Vector()};
+    Ray refracted{Point(), Vector()};
+    double kr = 0.0;
+    double kt = 0.0;
+};
+
+// Buffers the render functions fill from the samples of a band besides
+// the image, if given
+struct BandOutputs
+{
+    Denoiser *guides = nullptr;
+    AOVs *aovs = nullptr;
+};
+
+// Order the tiles of a band, and the pixels of a tile, are traced in
+enum PixelOrder
+{
+    SCANLINE_ORDER,
+    MORTON_ORDER,       // Z-order
+    HILBERT_ORDER
+};
 
 class Scene
 {
+    Arena arena;                    // owns objects, lights and the bvh
     std::vector<ObjectPtr> objects;
-    std::vector<LightPtr> lights;   // no ptr needed, but kept for consistency
+    std::vector<StreamedMeshPtr> meshes;   // out-of-core, kept out of bvh
+    std::vector<LightPtr> lights;
+    AliasTable lightTable;          // by power, built with the accelerator
+    unsigned lightSamples = 8;      // per hit, all lights when not more
+    bool shadows = false;
+    bool wavefront = false;         // renderBand breadth first
+    bool sortRays = false;          // of renderWavefront
+    uint64_t shadowEpoch = 0;       // keys the occluder caches, per build
+    std::vector<Material> materials;            // shared by all objects
+    std::map<Material, MaterialId> materialIds; // dedups addMaterial
     Point eye;
+    BVH bvh;
+    bool lazyBVH = false;
+    std::string cacheFile;      // empty: always build
+    uint64_t cacheKey = 0;
+    unsigned threads = 1;
+    unsigned tileSize = 32;
+    PixelOrder pixelOrder = HILBERT_ORDER;
+    unsigned samples = 1;       // per pixel, averaged
+    std::unique_ptr<Sampler> sampler{new StratifiedSampler(1)};
+    Philox rng{0};                  // for light selection
+    double noiseThreshold = 0.0;    // of renderAdaptive
+    double edgeThreshold = 0.1;     // of renderEdges
+    unsigned maxDepth = 5;          // of reflection and refraction
+    unsigned rayBudget = 0;         // per pixel, 0: none
+    std::atomic<uint64_t> secondaryRays{0};
+    std::atomic<uint64_t> shadowRays{0};
+    std::atomic<uint64_t> shadowsBlocked{0};
+    std::atomic<uint64_t> occluderTests{0};    // of a cached occluder
+    std::atomic<uint64_t> occluderHits{0};     // it still blocked the ray
 
     public:
 
@@ -25,13 +126,179 @@ class Scene
         // render the scene to the given image
         void render(Image &img);
 
+        // called with (pass, number of passes, pixel spacing of the pass)
+        // after every full pass
+        typedef std::function<void(unsigned, unsigned, unsigned)> PassCallback;
+
+        // render progressively until done or past the deadline, see
+        // renderProgressive in scene.cpp. Returns false when stopped early;
+        // tileSamples gets the samples per pixel of every tile (fractions
+        // for tiles that only got a coarse pass).
+        bool renderProgressive(Image &img,
+                               std::chrono::steady_clock::time_point deadline,
+                               std::vector<double> &tileSamples,
+                               PassCallback const &onPass = PassCallback());
+
+        // edge of the tiles of renderProgressive
+        unsigned progressiveTileSize() const;
+
+        // render rows [y0, y0 + band.height()) of an image of the given
+        // height (and band's width) into band. The render functions add
+        // the samples and their first hits to the outputs.
+        void renderBand(Image &band, unsigned y0, unsigned height,
+                        BandOutputs const &outputs = BandOutputs());
+
+        // render like renderBand, with samples per pixel as the average:
+        // pixels stop once the standard error of their luminance is below
+        // the noise threshold and the noisiest get more, see scene.cpp.
+        // counts gets the samples of every band pixel.
+        void renderAdaptive(Image &band, unsigned y0, unsigned height,
+                            std::vector<unsigned> &counts,
+                            BandOutputs const &outputs = BandOutputs());
+
+        // render with one ray through every pixel center, supersampling
+        // (samples per pixel) only pixels that differ from a neighbour in
+        // object, normal or by more than the edge threshold in a color
+        // channel. counts gets the rays of every band pixel.
+        void renderEdges(Image &band, unsigned y0, unsigned height,
+                         std::vector<unsigned> &counts,
+                         BandOutputs const &outputs = BandOutputs());
+
+        // nearest object along the ray closer than hit.t, or nullptr
+        Object *intersect(Ray const &ray, Hit &hit);
+
+        // color of a ray that hit obj, and its terms if lobes is given.
+        // With more lights than the light samples, as many lights picked
+        // by power stand in for all of them, see scene.cpp. With shadows
+        // a light hidden from the hit adds only its ambient term.
+        Color shade(Ray const &ray, Hit const &hit, Object const &obj,
+                    Lobes *lobes = nullptr,
+                    PathVertex const &vertex = PathVertex());
+
+
+        // allocate scene objects here, they live as long as the scene
+        Arena &getArena();
+
+        // id of the material in the table, identical materials share one
+        MaterialId addMaterial(Material const &material);
 
         void addObject(ObjectPtr obj);
         void addLight(Light const &light);
         void setEye(Triple const &position);
+        void setLazyBVH(bool lazy);
+
+        // render threads (0: all cores), tile edge, samples per pixel and
+        // their sampler (see Sampler::create, throws for unknown names)
+        // with its random seed
+        void setRenderSettings(unsigned threads, unsigned tileSize,
+                               unsigned samples,
+                               std::string const &sampler = "stratified",
+                               uint64_t seed = 0);
+        void setNoiseThreshold(double threshold);
+
+        // "scanline", "morton" or "hilbert", throws for other names
+        void setPixelOrder(std::string const &order);
+        void setEdgeThreshold(double threshold);
+
+        // bounces of reflected and refracted rays (at most 32), and the
+        // rays a pixel may trace over all its samples (0: no limit)
+        void setTraceLimits(unsigned maxDepth, unsigned rayBudget);
+
+        // lights evaluated per hit (at least 1)
+        void setLightSamples(unsigned samples);
+
+        // trace a shadow ray towards every light evaluated
+        void setShadows(bool shadows);
+
+        // let renderBand trace breadth first, see renderWavefront
+        void setWavefront(bool wavefront);
+
+        // let renderWavefront trace secondary and shadow rays in buckets
+        // of similar origin and direction
+        void setRaySorting(bool sort);
+        void setAcceleratorCache(std::string const &filename, uint64_t key);
+
+        // build (or load from the cache) the acceleration structure,
+        // call before render. Returns true when the cache was used.
+        bool buildAccelerator();
 
         unsigned getNumObject();
         unsigned getNumLights();
+        unsigned getNumBVHNodes();
+        uint64_t getNumSecondaryRays() const;
+        uint64_t getNumShadowRays() const;
+
+        // paging statistics of the streamed meshes
+        void reportStreaming(std::ostream &out);
+
+        // shadow rays traced and the hit rate of the occluder caches
+        void reportShadows(std::ostream &out);
+
+    private:
+        // trace, also giving the first hit. The ray is of sample s of
+        // image pixel (x, y), which keys the random numbers of its path.
+        Color trace(Ray const &ray, Surface &surface, unsigned x, unsigned y,
+                    unsigned s);
+
+        // light reflected and refracted at the hit of ray, see scene.cpp
+        Color secondary(Ray const &ray, Hit const &hit, Object const &obj,
+                        unsigned x, unsigned y, unsigned s);
+
+        // rays reflected and refracted at the hit of ray in
+        Scattered scatter(Ray const &in, Hit const &at,
+                          Material const &material) const;
+
+        // ambient term of a hit, one per light
+        Color ambientTerm(Material const &material) const;
+
+        // the lights a hit evaluates: all of them with weight 1, or as
+        // many as the light samples picked by power (see shade). Fills
+        // picked and weights (room for MAX_LIGHT_SAMPLES in scene.cpp,
+        // or the number of lights) and returns the count.
+        unsigned pickLights(PathVertex const &vertex, unsigned *picked,
+                            double *weights) const;
+
+        // weighted, unshadowed diffuse and specular terms of a light at a
+        // hit with normal N seen from V
+        void lightTerms(Point const &hit, Vector const &N, Vector const &V,
+                        Material const &material, Light const &light,
+                        double weight, Color &diffuse, Color &specular) const;
+
+        // origin of a shadow ray from hit (at distance t) towards light,
+        // off the surface on the light's side
+        Point shadowOrigin(Point const &hit, Vector const &N, double t,
+                           Light const &light) const;
+
+        // add the shadow rays of this thread to the scene's counts
+        void countShadowRays();
+
+        // whether light idx is hidden from P, already off the surface.
+        // Tests the object that last hid it from this thread first.
+        bool occluded(Point const &P, Light const &light, unsigned idx);
+
+        // add a sample of band pixel (x, y), its color and first hit, to
+        // the outputs
+        void record(BandOutputs const &outputs, unsigned x, unsigned y,
+                    Color const &color, Surface const &surface) const;
+
+        // primary ray for sample s of pixel (x, y) of an image h rows high
+        Ray primaryRay(unsigned x, unsigned y, unsigned h, unsigned s) const;
+
+        // same for sample s of an open ended sequence (renderAdaptive): of
+        // the sampler if it is one, else of the R2 sequence
+        Ray sequenceRay(unsigned x, unsigned y, unsigned h, unsigned s) const;
+
+        // ray through (x + dx, y + dy)
+        Ray pixelRay(unsigned x, unsigned y, unsigned h, double dx, double dy) const;
+
+        // renderBand in stages over queues of rays, see scene.cpp
+        void renderWavefront(Image &band, unsigned y0, unsigned height,
+                             BandOutputs const &outputs);
+
+        // render band rows [y0, y1), intersecting the streamed meshes per
+        // batch; yImg is the image row of band row 0
+        void renderRows(Image &band, unsigned y0, unsigned y1, unsigned yImg,
+                        unsigned height, BandOutputs const &outputs);
 };
 
 #endif
@@ -0,0 +1,206 @@
+#include "settings.h"
+
+#include "aovs.h"
+#include "json/json.h"
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+using namespace std;
+using json = nlohmann::json;
+
+namespace
+{
+    bool isPositive(json const &value)
+    {
+        return value.is_number() && value.get<double>() >= 1;
+    }
+
+    // A count that must be at least 1
+    unsigned positive(string const &key, json const &value)
+    {
+        if (!isPositive(value))
+            throw runtime_error("Unknown " + key + ": " + value.dump() + ".");
+        return value;
+    }
+}
+
+void Settings::read(json const &node)
+{
+    for (auto it = node.begin(); it != node.end(); ++it)
+        set(it.key(), it.value());
+}
+
+void Settings::set(string const &key, json const &value)
+{
+    if (key == "Resolution")
+    {
+        if (!value.is_array() || value.size() != 2
+            || !isPositive(value[0]) || !isPositive(value[1]))
+            throw runtime_error("Unknown resolution: " + value.dump() + ".");
+        width = value[0];
+        height = value[1];
+    }
+    else if (key == "SamplesPerPixel")
+        samples = positive(key, value);
+    else if (key == "Sampler")
+        sampler = value.get<string>();
+    else if (key == "Seed")
+        seed = value.get<uint64_t>();
+    else if (key == "Progressive")
+        progressive = value;
+    else if (key == "PreviewFile")
+        previewFile = value.get<string>();
+    else if (key == "TimeBudget")
+        timeBudget = value;
+    else if (key == "SampleMap")
+        sampleMap = value.get<string>();
+    else if (key == "NoiseThreshold")
+        noiseThreshold = value;
+    else if (key == "AntiAliasing")
+    {
+        // "full" supersamples every pixel, "edge" only those on edges
+        string aa = value;
+        if (aa != "full" && aa != "edge")
+            throw runtime_error("Unknown anti-aliasing: \"" + aa + "\".");
+        edgeAA = aa == "edge";
+    }
+    else if (key == "EdgeThreshold")
+        edgeThreshold = value;
+    else if (key == "Denoise")
+        denoise = value;
+    else if (key == "MaxDepth")
+        maxDepth = value;
+    else if (key == "RayBudget")
+        rayBudget = value;
+    else if (key == "LightSamples")
+        lightSamples = value;
+    else if (key == "Shadows")
+        shadows = value;
+    else if (key == "Wavefront")
+        wavefront = value;
+    else if (key == "SortRays")
+        sortRays = value;
+    else if (key == "Threads")
+        threads = value;
+    else if (key == "TileSize")
+        tileSize = positive(key, value);
+    else if (key == "PixelOrder")
+        pixelOrder = value.get<string>();
+    else if (key == "BandRows")
+        bandRows = value == 0 ? 0 : positive(key, value);   // 0: whole image
+    else if (key == "Accelerator")
+    {
+        // "bvh" builds the tree up front, "lazybvh" splits nodes on first use
+        string accel = value;
+        if (accel != "bvh" && accel != "lazybvh")
+            throw runtime_error("Unknown accelerator: \"" + accel + "\".");
+        lazyBVH = accel == "lazybvh";
+    }
+    else if (key == "Cache")
+        cache = value;
+    else if (key == "HugePages")
+        hugePages = value;
+    else if (key == "MemoryBudget")
+        memoryBudget = value.get<double>() * (1 << 20);     // MiB
+    else if (key == "Precision")
+    {
+        string format = value;
+        if (format == "float") framebuffer = Image::RGB32F;
+        else if (format == "half") framebuffer = Image::RGB16F;
+        else if (format == "rgba8") framebuffer = Image::RGBA8;
+        else throw runtime_error("Unknown precision: \"" + format + "\".");
+    }
+    else if (key == "OutputFormat")
+    {
+        string format = value;
+        if (format != "png" && format != "pfm" && format != "exr"
+            && format != "rgb" && format != "y4m")
+            throw runtime_error("Unknown output format: \"" + format + "\".");
+        outputFormat = format;
+    }
+    else if (key == "AOVs")
+    {
+        // a list of names, or one string of names separated by commas
+        vector<string> names;
+        if (value.is_array())
+            names = value.get<vector<string>>();
+        else if (!value.get<string>().empty())
+        {
+            string list = value;
+            for (size_t pos = 0; pos <= list.size(); )
+            {
+                size_t comma = min(list.find(',', pos), list.size());
+                names.push_back(list.substr(pos, comma - pos));
+                pos = comma + 1;
+            }
+        }
+        for (string const &name : names)
+            if (AOVs::layer(name) == AOVs::NUM_LAYERS)
+                throw runtime_error("Unknown AOV: \"" + name + "\".");
+        aovs = names;
+    }
+    else if (key == "sRGB")
+        srgb = value;
+    else if (key == "Dither")
+        dither = value;
+    else if (key == "PNGCompression")
+        pngLevel = min(max(value.get<int>(), 0), 9);
+    else if (key == "ToneMap")
+    {
+        string op = value;
+        if (op == "linear") toneMap = Image::LINEAR;
+        else if (op == "reinhard") toneMap = Image::REINHARD;
+        else if (op == "aces") toneMap = Image::ACES;
+        else throw runtime_error("Unknown tone mapping: \"" + op + "\".");
+        toneMapping = true;
+    }
+    else if (key == "Exposure")
+    {
+        exposure = value;
+        toneMapping = true;
+    }
+    else if (key == "FrameRate")
+        frameRate = value;
+    else
+        throw runtime_error("Unknown setting: \"" + key + "\".");
+}
+
+void Settings::set(string const &option, string const &value)
+{
+    // 1. samples-per-pixel -> SamplesPerPixel, a few names are all caps.
+    string key;
+    bool upper = true;
+    for (char c : option)
+    {
+        if (c == '-')
+            upper = true;
+        else
+        {
+            key += upper ? toupper(c) : c;
+            upper = false;
+        }
+    }
+    if (key == "Srgb") key = "sRGB";
+    if (key == "Aovs") key = "AOVs";
+    if (key == "Pngcompression" || key == "PngCompression") key = "PNGCompression";
+
+    // 2. Values as in the scene file, bare words are strings.
+    json parsed;
+    size_t x = value.find('x');
+    if (key == "Resolution" && x != string::npos)
+        parsed = json::array({stoul(value.substr(0, x)), stoul(value.substr(x + 1))});
+    else
+    {
+        try
+        {
+            parsed = json::parse(value);
+        }
+        catch (exception const &)
+        {
+            parsed = value;
+        }
+    }
+    set(key, parsed);
+}
@@ -0,0 +1,73 @@
+#ifndef SETTINGS_H_
+#define SETTINGS_H_
+
+#include "image.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "json/json_fwd.h"
+
+// Rendering settings, read from the "Settings" section of the scene file.
+// Every setting can be overridden on the command line: --samples-per-pixel 4
+// sets "SamplesPerPixel", values are given as in the scene file (strings
+// without quotes, and "--resolution 800x600" also works).
+class Settings
+{
+    public:
+        // Image
+        unsigned width = 400;
+        unsigned height = 400;
+        unsigned samples = 1;                       // per pixel
+        std::string sampler = "stratified";         // see sampler.h
+        uint64_t seed = 0;                          // of all random numbers
+        bool progressive = false;                   // preview every pass
+        std::string previewFile;                    // PNG, for non-streams
+        double timeBudget = 0.0;                    // seconds, 0: none
+        std::string sampleMap;                      // samples per tile file
+        double noiseThreshold = 0.0;                // adaptive sampling, 0: off
+        bool edgeAA = false;                        // "AntiAliasing": "edge"
+        double edgeThreshold = 0.1;                 // color difference of edges
+        bool denoise = false;                       // a-trous filter after tracing
+        unsigned maxDepth = 5;                      // reflection, refraction
+        unsigned rayBudget = 0;                     // per pixel, 0: no limit
+        unsigned lightSamples = 8;                  // lights per hit
+        bool shadows = false;                       // trace shadow rays
+        bool wavefront = false;                     // breadth first tracing
+        bool sortRays = false;                      // of the wavefront
+
+        // Performance
+        unsigned threads = 0;                       // 0: all cores
+        unsigned tileSize = 32;                     // pixels, square tiles
+        std::string pixelOrder = "hilbert";         // of tiles and pixels
+        unsigned bandRows = 0;                      // 0: render in memory
+        bool lazyBVH = false;                       // "Accelerator"
+        bool cache = true;                          // cache the built BVH
+        bool hugePages = false;
+        size_t memoryBudget = size_t(256) << 20;    // for streamed meshes
+        Image::Format framebuffer = Image::RGB32F;  // "Precision"
+
+        // Output
+        std::string outputFormat;                   // empty: by extension
+        std::vector<std::string> aovs;              // layers, see aovs.h
+        bool srgb = false;                          // encode output as sRGB
+        bool dither = false;                        // ordered dither to 8 bit
+        int pngLevel = 6;                           // PNG compression, 0 - 9
+        bool toneMapping = false;                   // off: write linear values
+        Image::ToneMap toneMap = Image::LINEAR;
+        double exposure = 0.0;                      // in stops
+        unsigned frameRate = 25;                    // of y4m output
+
+        // Apply every key of a "Settings" section
+        void read(nlohmann::json const &node);
+
+        // Apply a single setting, throws on unknown keys or values
+        void set(std::string const &key, nlohmann::json const &value);
+
+        // Command line form: "samples-per-pixel", "4"
+        void set(std::string const &option, std::string const &value);
+};
+
+#endif
@@ -36,6 +36,8 @@ Hit Sphere::intersect(Ray const &ray)
 
     // Compute distance.
     double d = -(ray.D.dot(diff)) - sqrt(radicand);
+    if (d <= 0)     // from inside (refracted rays): the far side
+        d = -(ray.D.dot(diff)) + sqrt(radicand);
     Point intPoint = ray.at(d);
 
     /*Vector OC = (position - ray.O).normalized();
@@ -64,3 +66,9 @@ Sphere::Sphere(Point const &pos, double radius)
     position(pos),
     r(radius)
 {}
+
+AABB Sphere::bounds() const
+{
+    Vector extent(r, r, r);
+    return AABB(position - extent, position + extent);
+}
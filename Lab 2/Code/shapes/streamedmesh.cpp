@@ -0,0 +1,436 @@
+#include "streamedmesh.h"
+
+#include "../morton.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <queue>
+
+using namespace std;
+
+// File layout: Header, float[numBlocks][6] block bounds, padding up to
+// BLOCK_SIZE, then the blocks. Each block holds a BlockHeader, the cluster
+// bounds and then the triangles.
+namespace
+{
+    char const STREAM_MAGIC[8] = {'R', 'A', 'Y', 'M', 'E', 'S', 'H', '1'};
+
+    struct Header
+    {
+        char magic[8];
+        uint64_t key;
+        uint64_t numTriangles;
+        uint32_t numBlocks;
+        uint32_t blockSize;
+    };
+
+    struct BlockHeader
+    {
+        uint32_t numTriangles;
+        uint32_t numClusters;
+        uint32_t pad[2];
+    };
+
+    size_t const CLUSTER_OFFSET = sizeof(BlockHeader);
+    size_t const TRIANGLE_OFFSET = CLUSTER_OFFSET
+        + StreamedMesh::CLUSTERS_PER_BLOCK * 6 * sizeof(float);
+
+    static_assert(TRIANGLE_OFFSET + StreamedMesh::TRIANGLES_PER_BLOCK * 9 * sizeof(float)
+                  <= StreamedMesh::BLOCK_SIZE, "blocks overflow");
+
+    size_t dataOffset(uint32_t numBlocks)
+    {
+        size_t size = sizeof(Header) + numBlocks * 6 * sizeof(float);
+        return (size + StreamedMesh::BLOCK_SIZE - 1)
+            / StreamedMesh::BLOCK_SIZE * StreamedMesh::BLOCK_SIZE;
+    }
+
+    void growBounds(float *box, float const *p)
+    {
+        for (unsigned i = 0; i != 3; ++i)
+        {
+            box[i] = min(box[i], p[i]);
+            box[i + 3] = max(box[i + 3], p[i]);
+        }
+    }
+
+    Point centroidOf(float const *t)
+    {
+        return Point(t[0] + t[3] + t[6], t[1] + t[4] + t[7],
+                     t[2] + t[5] + t[8]) / 3.0;
+    }
+
+    // A triangle at its place along the Morton curve, as stored in the
+    // sorted runs of StreamedMesh::Writer
+    struct Record
+    {
+        uint32_t code;
+        uint64_t index;         // in input order, breaks ties
+        float tri[9];
+
+        bool operator<(Record const &other) const
+        {
+            return code != other.code ? code < other.code : index < other.index;
+        }
+    };
+
+    // Slab test of a float box against [0, tmax)
+    bool hitsBox(float const *box, Ray const &ray, Vector const &invD, double tmax)
+    {
+        return AABB(Point(box[0], box[1], box[2]), Point(box[3], box[4], box[5]))
+            .hit(ray, invD, tmax);
+    }
+}
+
+// A block exposed as an object, so the block BVH can be a plain BVH
+class MeshBlock: public Object
+{
+    StreamedMesh *d_mesh;
+    uint32_t d_index;
+    AABB d_box;
+
+    public:
+        MeshBlock(StreamedMesh *mesh, uint32_t index, AABB const &box)
+        :
+            d_mesh(mesh),
+            d_index(index),
+            d_box(box)
+        {}
+
+        virtual Hit intersect(Ray const &ray)
+        {
+            Hit hit(numeric_limits<double>::infinity(), Vector());
+            d_mesh->intersectBlock(d_index, ray, hit);
+            return hit.t < numeric_limits<double>::infinity() ? hit : Hit::NO_HIT();
+        }
+
+        virtual AABB bounds() const
+        {
+            return d_box;
+        }
+};
+
+StreamedMesh::StreamedMesh()
+:
+    d_numTriangles(0)
+{}
+
+// --- Writer ------------------------------------------------------------------
+
+StreamedMesh::Writer::Writer(string const &filename, uint64_t key, size_t budget)
+:
+    d_filename(filename),
+    d_key(key),
+    d_runSize(max<size_t>(TRIANGLES_PER_BLOCK, budget / sizeof(Record))),
+    d_spill(filename + ".tris", ios::binary | ios::trunc),
+    d_count(0)
+{}
+
+StreamedMesh::Writer::~Writer()
+{
+    // Scratch files of an unfinished (or failed) conversion
+    d_spill.close();
+    std::remove((d_filename + ".tris").c_str());
+    std::remove((d_filename + ".runs").c_str());
+    std::remove((d_filename + ".tmp").c_str());
+}
+
+void StreamedMesh::Writer::add(float const *triangle)
+{
+    d_spill.write(reinterpret_cast<char const *>(triangle), 9 * sizeof(float));
+    d_centroids.grow(centroidOf(triangle));
+    ++d_count;
+}
+
+bool StreamedMesh::Writer::finish()
+{
+    d_spill.close();
+    if (!d_spill)
+        return false;
+
+    // 1. Sort the spilled triangles in runs that fit the budget, along a
+    //    Morton curve through their centroids, so neighbouring triangles
+    //    end up in the same block.
+    string runsName = d_filename + ".runs";
+    Vector extent = d_centroids.max - d_centroids.min;
+    {
+        ifstream spill(d_filename + ".tris", ios::binary);
+        ofstream runs(runsName, ios::binary | ios::trunc);
+        vector<Record> run;
+        for (uint64_t first = 0; first < d_count; first += d_runSize)
+        {
+            run.resize(min<uint64_t>(d_runSize, d_count - first));
+            for (size_t i = 0; i != run.size(); ++i)
+            {
+                Record &rec = run[i];
+                spill.read(reinterpret_cast<char *>(rec.tri), sizeof(rec.tri));
+                Point centroid = centroidOf(rec.tri);
+                uint32_t cell[3];
+                for (unsigned axis = 0; axis != 3; ++axis)
+                    cell[axis] = extent.data[axis] > 0
+                        ? min(1023.0, (centroid.data[axis] - d_centroids.min.data[axis])
+                                      / extent.data[axis] * 1024.0)
+                        : 0;
+                rec.code = morton3(cell[0], cell[1], cell[2]);
+                rec.index = first + i;
+            }
+            sort(run.begin(), run.end());
+            runs.write(reinterpret_cast<char const *>(run.data()),
+                       run.size() * sizeof(Record));
+        }
+        if (!spill || !runs)
+            return false;
+    }
+    std::remove((d_filename + ".tris").c_str());
+
+    // 2. Merge the runs, each read through a window that together fit the
+    //    budget again.
+    struct Cursor
+    {
+        uint64_t next;          // record in the runs file
+        uint64_t end;
+        vector<Record> window;
+        size_t pos;
+    };
+
+    size_t numRuns = (d_count + d_runSize - 1) / d_runSize;
+    size_t windowSize = max<size_t>(1, d_runSize / max<size_t>(1, numRuns));
+    ifstream runs(runsName, ios::binary);
+    vector<Cursor> cursors(numRuns);
+    auto refill = [&](Cursor &cursor)
+    {
+        cursor.window.resize(min<uint64_t>(windowSize, cursor.end - cursor.next));
+        cursor.pos = 0;
+        runs.seekg(cursor.next * sizeof(Record));
+        runs.read(reinterpret_cast<char *>(cursor.window.data()),
+                  cursor.window.size() * sizeof(Record));
+        cursor.next += cursor.window.size();
+    };
+    auto later = [&](size_t a, size_t b)
+    {
+        return cursors[b].window[cursors[b].pos] < cursors[a].window[cursors[a].pos];
+    };
+    priority_queue<size_t, vector<size_t>, decltype(later)> heap(later);
+    for (size_t r = 0; r != numRuns; ++r)
+    {
+        cursors[r].next = uint64_t(r) * d_runSize;
+        cursors[r].end = min<uint64_t>(d_count, cursors[r].next + d_runSize);
+        refill(cursors[r]);
+        heap.push(r);
+    }
+
+    // 3. Pack the merged triangles, writing each block once it is full.
+    //    The header and block bounds go in front once all are known.
+    uint32_t numBlocks = (d_count + TRIANGLES_PER_BLOCK - 1) / TRIANGLES_PER_BLOCK;
+    vector<float> blockBounds(numBlocks * 6);
+    vector<char> block(BLOCK_SIZE);
+    float *clusters = reinterpret_cast<float *>(block.data() + CLUSTER_OFFSET);
+    float *tris = reinterpret_cast<float *>(block.data() + TRIANGLE_OFFSET);
+    float inf = numeric_limits<float>::infinity();
+
+    string tmpname = d_filename + ".tmp";
+    ofstream out(tmpname, ios::binary | ios::trunc);
+    out.seekp(dataOffset(numBlocks));
+    for (uint32_t b = 0; b != numBlocks; ++b)
+    {
+        BlockHeader header = {};
+        header.numTriangles = min<uint64_t>(TRIANGLES_PER_BLOCK,
+                                            d_count - uint64_t(b) * TRIANGLES_PER_BLOCK);
+        header.numClusters = (header.numTriangles + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+        fill(block.begin(), block.end(), 0);
+        memcpy(block.data(), &header, sizeof(header));
+
+        float *bbox = &blockBounds[6 * b];
+        fill(bbox, bbox + 3, inf);
+        fill(bbox + 3, bbox + 6, -inf);
+        for (uint32_t i = 0; i != header.numTriangles; ++i)
+        {
+            float *cbox = clusters + 6 * (i / CLUSTER_SIZE);
+            if (i % CLUSTER_SIZE == 0)
+            {
+                fill(cbox, cbox + 3, inf);
+                fill(cbox + 3, cbox + 6, -inf);
+            }
+
+            size_t r = heap.top();
+            heap.pop();
+            Cursor &cursor = cursors[r];
+            float const *src = cursor.window[cursor.pos].tri;
+            copy(src, src + 9, tris + 9 * i);
+            for (unsigned v = 0; v != 3; ++v)
+            {
+                growBounds(cbox, src + 3 * v);
+                growBounds(bbox, src + 3 * v);
+            }
+
+            if (++cursor.pos == cursor.window.size() && cursor.next != cursor.end)
+                refill(cursor);
+            if (cursor.pos != cursor.window.size())
+                heap.push(r);
+        }
+        out.write(block.data(), block.size());
+    }
+    if (!runs)
+        return false;
+    runs.close();
+    std::remove(runsName.c_str());
+
+    Header header;
+    memcpy(header.magic, STREAM_MAGIC, sizeof(STREAM_MAGIC));
+    header.key = d_key;
+    header.numTriangles = d_count;
+    header.numBlocks = numBlocks;
+    header.blockSize = BLOCK_SIZE;
+
+    vector<char> head(dataOffset(numBlocks), 0);
+    memcpy(head.data(), &header, sizeof(header));
+    memcpy(head.data() + sizeof(header), blockBounds.data(),
+           blockBounds.size() * sizeof(float));
+    out.seekp(0);
+    out.write(head.data(), head.size());
+    out.close();
+    if (!out)
+        return false;
+    return rename(tmpname.c_str(), d_filename.c_str()) == 0;
+}
+
+// --- StreamedMesh ------------------------------------------------------------
+
+bool StreamedMesh::open(string const &filename, uint64_t key, size_t budget,
+                        unsigned threads)
+{
+    // 1. Read the header and block bounds, the only parts kept in memory.
+    ifstream in(filename, ios::binary);
+    Header header;
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))
+        || memcmp(header.magic, STREAM_MAGIC, sizeof(STREAM_MAGIC)) != 0
+        || header.key != key
+        || header.blockSize != BLOCK_SIZE)
+        return false;
+
+    vector<float> blockBounds(header.numBlocks * 6);
+    if (!in.read(reinterpret_cast<char *>(blockBounds.data()),
+                 blockBounds.size() * sizeof(float)))
+        return false;
+    in.close();
+
+    // 2. Map the blocks and build the block BVH.
+    if (!d_cache.open(filename, dataOffset(header.numBlocks), BLOCK_SIZE,
+                      header.numBlocks, budget, threads))
+        return false;
+
+    d_numTriangles = header.numTriangles;
+    d_bounds = AABB();
+    d_arena.release();
+    d_blocks.clear();
+    for (uint32_t b = 0; b != header.numBlocks; ++b)
+    {
+        float const *f = &blockBounds[6 * b];
+        AABB box(Point(f[0], f[1], f[2]), Point(f[3], f[4], f[5]));
+        d_blocks.push_back(d_arena.create<MeshBlock>(this, b, box));
+        d_bounds.grow(box);
+    }
+    d_bvh.build(d_blocks, false, d_arena);
+    return true;
+}
+
+Hit StreamedMesh::intersect(Ray const &ray)
+{
+    Hit hit(numeric_limits<double>::infinity(), Vector());
+    if (d_bvh.intersect(ray, hit) < 0)
+        return Hit::NO_HIT();
+    return hit;
+}
+
+AABB StreamedMesh::bounds() const
+{
+    return d_bounds;
+}
+
+void StreamedMesh::intersectBatch(vector<Ray> const &rays, vector<Hit> &hits)
+{
+    // 1. Queue every ray at all blocks it passes through. Testing a ray
+    //    against a superset of the blocks it would visit still yields
+    //    its nearest hit.
+    vector<vector<uint32_t>> queues(d_blocks.size());
+    vector<uint32_t> found;
+    for (uint32_t r = 0; r != rays.size(); ++r)
+    {
+        found.clear();
+        d_bvh.collect(rays[r], found);
+        for (uint32_t block : found)
+            queues[block].push_back(r);
+    }
+
+    // 2. Drain the queues in file order.
+    for (uint32_t block = 0; block != queues.size(); ++block)
+        for (uint32_t r : queues[block])
+            intersectBlock(block, rays[r], hits[r]);
+}
+
+void StreamedMesh::intersectBlock(uint32_t block, Ray const &ray, Hit &minHit)
+{
+    char const *data = d_cache.acquire(block);
+
+    BlockHeader header;
+    memcpy(&header, data, sizeof(header));
+    float const *clusters = reinterpret_cast<float const *>(data + CLUSTER_OFFSET);
+    float const *tris = reinterpret_cast<float const *>(data + TRIANGLE_OFFSET);
+
+    Vector invD(1.0 / ray.D.x, 1.0 / ray.D.y, 1.0 / ray.D.z);
+    for (uint32_t c = 0; c != header.numClusters; ++c)
+    {
+        if (!hitsBox(clusters + 6 * c, ray, invD, minHit.t))
+            continue;
+
+        uint32_t end = min<uint32_t>(header.numTriangles, (c + 1) * CLUSTER_SIZE);
+        for (uint32_t i = c * CLUSTER_SIZE; i != end; ++i)
+        {
+            // Moller-Trumbore, same face normal as Triangle
+            float const *t = tris + 9 * i;
+            Point a(t[0], t[1], t[2]);
+            Vector e1 = Point(t[3], t[4], t[5]) - a;
+            Vector e2 = Point(t[6], t[7], t[8]) - a;
+
+            Vector p = ray.D.cross(e2);
+            double det = e1.dot(p);
+            if (fabs(det) < 1E-12)
+                continue;
+            double invDet = 1.0 / det;
+
+            Vector s = ray.O - a;
+            double u = s.dot(p) * invDet;
+            if (u < 0 || u > 1)
+                continue;
+            Vector q = s.cross(e1);
+            double v = ray.D.dot(q) * invDet;
+            if (v < 0 || u + v > 1)
+                continue;
+
+            double dist = e2.dot(q) * invDet;
+            if (dist > 0 && dist < minHit.t)
+                minHit = Hit(dist, e1.cross(e2).normalized());
+        }
+    }
+
+    d_cache.release(block);
+}
+
+uint64_t StreamedMesh::numTriangles() const
+{
+    return d_numTriangles;
+}
+
+unsigned StreamedMesh::numBlocks() const
+{
+    return d_blocks.size();
+}
+
+BlockCache const &StreamedMesh::cache() const
+{
+    return d_cache;
+}
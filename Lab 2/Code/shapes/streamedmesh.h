@@ -0,0 +1,86 @@
+#ifndef STREAMEDMESH_H_
+#define STREAMEDMESH_H_
+
+#include "../object.h"
+#include "../arena.h"
+#include "../blockcache.h"
+#include "../bvh.h"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+class StreamedMesh;
+typedef StreamedMesh *StreamedMeshPtr;
+
+// Triangle mesh that stays on disk. Triangles are sorted along a Morton
+// curve and packed into page-aligned blocks (the leaves of a small in-memory
+// BVH over the blocks), which are paged in on demand through a BlockCache.
+class StreamedMesh: public Object
+{
+    friend class MeshBlock;
+
+    public:
+        enum : unsigned
+        {
+            BLOCK_SIZE = 1 << 16,       // bytes, multiple of the page size
+            CLUSTER_SIZE = 16,          // triangles sharing one bounding box
+            CLUSTERS_PER_BLOCK = 109,
+            TRIANGLES_PER_BLOCK = CLUSTERS_PER_BLOCK * CLUSTER_SIZE
+        };
+
+        // Lays out a stream of triangles in a block file within a memory
+        // budget: the triangles are spilled to disk, sorted in runs that
+        // fit the budget and merged, writing every block once it is full.
+        class Writer
+        {
+            std::string d_filename;
+            uint64_t d_key;
+            size_t d_runSize;           // triangles sorted in memory at once
+            std::ofstream d_spill;      // unsorted triangles
+            uint64_t d_count;
+            AABB d_centroids;
+
+            public:
+                Writer(std::string const &filename, uint64_t key, size_t budget);
+                ~Writer();
+
+                // Append a triangle (9 floats: a, b, c)
+                void add(float const *triangle);
+
+                // Sort and write the block file, false on I/O errors
+                bool finish();
+        };
+
+        StreamedMesh();
+
+        // Map a block file written with the same key, keeping at most
+        // budget bytes of it resident (but at least a block per thread)
+        bool open(std::string const &filename, uint64_t key, size_t budget,
+                  unsigned threads);
+
+        virtual Hit intersect(Ray const &ray);
+        virtual AABB bounds() const;
+
+        // Nearest hits (closer than hits[i].t) for a batch of rays. Rays are
+        // queued per block first, so each block is paged in once per batch
+        // instead of once per ray.
+        void intersectBatch(std::vector<Ray> const &rays, std::vector<Hit> &hits);
+
+        uint64_t numTriangles() const;
+        unsigned numBlocks() const;
+        BlockCache const &cache() const;
+
+    private:
+        void intersectBlock(uint32_t block, Ray const &ray, Hit &hit);
+
+        Arena d_arena;                  // blocks and their BVH
+        std::vector<ObjectPtr> d_blocks;
+        BVH d_bvh;
+        BlockCache d_cache;
+        AABB d_bounds;
+        uint64_t d_numTriangles;
+};
+
+#endif
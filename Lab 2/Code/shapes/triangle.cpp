@@ -65,3 +65,12 @@ Triangle::Triangle(Point a, Point b, Point c)
     b(b), 
     c(c)
 {}
+
+AABB Triangle::bounds() const
+{
+    AABB box;
+    box.grow(a);
+    box.grow(b);
+    box.grow(c);
+    return box;
+}
@@ -15,6 +15,7 @@ class Triangle: public Object
         bool withinTriangle (Point P, Vector N);
 
         virtual Hit intersect(Ray const &ray);
+        virtual AABB bounds() const;
 
         Point a, b, c;
 };